@@ -12,7 +12,8 @@
  *    - Force feedback enabled
  *
  * Known issues:
- *    - Shoulder triggers LT and RT work as buttons rather than triggers
+ *    - Shoulder triggers LT and RT work as buttons by default,
+ *      the analog trigger mode is optional
  *
  * Additional information:
  *    - Experimental: L4 and R4 buttons require a macro
@@ -35,59 +36,346 @@
 
 #define PACKET_SIZE 32
 
+// Bytes of an input report the driver actually looks at
+#define REPORT_SIZE 14
+
+// Number of input URBs kept in flight
+#define IN_URBS_MIN 2
+#define IN_URBS_MAX 8
+
+// Rumble mailbox layout: strong motor byte, weak motor byte, pending flag
+#define RUMBLE_PENDING BIT(16)
+#define RUMBLE_MOTORS(value) ((value) & 0xffff)
+#define RUMBLE_UNKNOWN -1 // The gamepad may have any motor values
+#define RUMBLE_INTERVAL_MAX 1000
+#define RUMBLE_STRONG(value) ((value) & 0xff)
+#define RUMBLE_WEAK(value) (((value) >> 8) & 0xff)
+
+// Stick calibration
+#define STICK_MAX 32767
+#define CURVE_POINTS_MAX 17
+#define CURVE_LUT_SHIFT 7 // 256 table steps over the stick range
+#define CURVE_LUT_STEPS ((STICK_MAX >> CURVE_LUT_SHIFT) + 1)
+#define CURVE_LUT_SIZE (CURVE_LUT_STEPS + 1)
+
+// Stick filter
+#define FILTER_REPORTS_MAX 64 // Longest smoothing, in reports
+#define FILTER_SPEED 64       // Stick speed in steps per report that halves the smoothing
+#define FILTER_HOLD 16        // Smaller changes of a resting stick are noise, like the axis fuzz
+
+// Button mapping
+#define CHORDS_MAX 8
+#define CHORD_BUTTONS_MAX 8 // Buttons used by all chords together
+#define ACTIONS_MAX 8
+
+// Turbo, presses per second
+#define TURBO_RATE_MIN 1
+#define TURBO_RATE_MAX 50
+
+// Force feedback
+#define FF_EFFECTS 16
+#define FF_LEVEL_STEP 128    // Change of an effect level that changes a motor byte
+#define FF_STEP_MIN_US 4000  // The motors can't follow faster changes anyway
+#define FF_WAVE_STEPS 32     // Samples per period of smooth waves
+
+// Raw report channel
+#define RAW_ENTRIES_MIN 16
+#define RAW_ENTRIES_MAX 65536
+
+// Benchmark in debugfs
+#define BENCH_RECORDING 720 // Reports per recorded stream, two turns of the sticks
+#define BENCH_PACKETS_MAX 100000000
+#define BENCH_RUMBLE_BURST 4 // Rumble requests per output transfer
+
+// Slow polling while idle, milliseconds
+#define SLOW_AFTER_MAX 600000
+#define SLOW_INTERVAL_MIN 2
+#define SLOW_INTERVAL_MAX 1000
+
+// Recovery after transfer errors, the delay doubles with every attempt
+#define RECOVER_DELAY_MIN_MS 1
+#define RECOVER_DELAY_MAX_MS 128
+
+// Bits in usb_out_flags
+#define GAMEPAD_OUT_BUSY 0   // The output URB is owned by a transfer
+#define GAMEPAD_OUT_HALTED 1 // The endpoint stalled, the recovery owns the URB
+
+// Bits in usb_in_recover, the bits below are the input slots
+#define GAMEPAD_IN_HALTED IN_URBS_MAX // The endpoint stalled
+
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/pm_runtime.h>
+#include <linux/hrtimer.h>
+#include <linux/fixp-arith.h>
+#include <linux/version.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/log2.h>
+#include <linux/seqlock.h>
+#include <linux/sched/signal.h>
 
 #include <linux/usb.h>
 #include <linux/input.h>
 #include <linux/usb/input.h>
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 // Some logging macros
 #define log_info(fmt, ...) printk(KERN_INFO "" DRIVER_NAME ": " fmt, ##__VA_ARGS__)
 #define log_err(fmt, ...) printk(KERN_ERR "" DRIVER_NAME ": " fmt, ##__VA_ARGS__)
+#define log_err_ratelimited(fmt, ...) printk_ratelimited(KERN_ERR "" DRIVER_NAME ": " fmt, ##__VA_ARGS__)
+
+// Module parameters
+static unsigned int in_urbs = 2;
+module_param(in_urbs, uint, 0444);
+MODULE_PARM_DESC(in_urbs, "Number of input URBs kept in flight (" __stringify(IN_URBS_MIN) "-" __stringify(IN_URBS_MAX) ", default 2)");
+
+static unsigned int in_interval;
+module_param(in_interval, uint, 0444);
+MODULE_PARM_DESC(in_interval, "Input polling interval in bInterval units (1 = 1 ms on the 2.4G dongle), 0 uses the endpoint descriptor");
+
+static unsigned int out_interval;
+module_param(out_interval, uint, 0444);
+MODULE_PARM_DESC(out_interval, "Output polling interval in bInterval units, 0 uses the endpoint descriptor");
+
+static unsigned int trigger_mode;
+module_param(trigger_mode, uint, 0444);
+MODULE_PARM_DESC(trigger_mode, "LT and RT as 0 = buttons (default), 1 = analog axes, 2 = both");
+
+static unsigned int rumble_interval = 10;
+module_param(rumble_interval, uint, 0444);
+MODULE_PARM_DESC(rumble_interval, "Minimum time between two rumble messages in milliseconds, 0 = no limit, default 10");
+
+static unsigned int idle_timeout;
+module_param(idle_timeout, uint, 0444);
+MODULE_PARM_DESC(idle_timeout, "Suspend the gamepad after this many seconds without input, 0 = never (default)");
+
+static unsigned int slow_after;
+module_param(slow_after, uint, 0444);
+MODULE_PARM_DESC(slow_after, "Poll slower after this many milliseconds without a change, 0 = never (default)");
+
+static unsigned int slow_interval = 8;
+module_param(slow_interval, uint, 0444);
+MODULE_PARM_DESC(slow_interval, "Milliseconds between two input transfers while polling slower (" __stringify(SLOW_INTERVAL_MIN) "-" __stringify(SLOW_INTERVAL_MAX) ", default 8)");
+
+static bool timestamp_adjust;
+module_param(timestamp_adjust, bool, 0444);
+MODULE_PARM_DESC(timestamp_adjust, "Date input events back by half the polling period, the average age of a report (default off)");
+
+static bool defer_input = true;
+module_param(defer_input, bool, 0444);
+MODULE_PARM_DESC(defer_input, "Register the input device with the first report instead of during probe (default on)");
+
+static bool raw_device;
+module_param(raw_device, bool, 0444);
+MODULE_PARM_DESC(raw_device, "Create a /dev/8bd-u2cw-raw<n> device with the raw input reports (default off)");
+
+static unsigned int raw_entries = 1024;
+module_param(raw_entries, uint, 0444);
+MODULE_PARM_DESC(raw_entries, "Reports kept in the raw device ring, a power of two (" __stringify(RAW_ENTRIES_MIN) "-" __stringify(RAW_ENTRIES_MAX) ", default 1024)");
+
+// Trigger modes
+enum gamepad_trigger_mode {
+	GAMEPAD_TRIGGER_DIGITAL, // BTN_TL2 and BTN_TR2
+	GAMEPAD_TRIGGER_ANALOG,  // ABS_Z and ABS_RZ
+	GAMEPAD_TRIGGER_BOTH,
+	GAMEPAD_TRIGGER_MODE_COUNT
+};
 
-// List all supported devices using vendor and product id
-static const struct usb_device_id module_device_table[] = {
-	// Vendor id: 0x2dc8 8bitdo
-	{ USB_DEVICE(0x2dc8, 0x310a) }, // Product id: 0x310a Ultimate 2C
-	{ }
+static const char * const gamepad_trigger_mode_names[] = {
+	[GAMEPAD_TRIGGER_DIGITAL] = "digital",
+	[GAMEPAD_TRIGGER_ANALOG]  = "analog",
+	[GAMEPAD_TRIGGER_BOTH]    = "both",
 };
 
-// Button, trigger and axis states
-struct gamepad_state {
+// Button bits
+// Bits 0-15 are taken as they are from the report bytes 2 (low) and 3 (high),
+// the bits above are virtual buttons created by the driver.
+enum gamepad_button {
+
+	// Report byte 2
+	GAMEPAD_DPAD_TOP,
+	GAMEPAD_DPAD_BOTTOM,
+	GAMEPAD_DPAD_LEFT,
+	GAMEPAD_DPAD_RIGHT,
+	GAMEPAD_BUTTON_PLUS,
+	GAMEPAD_BUTTON_MINUS,
+	GAMEPAD_BUTTON_STICK_LEFT,
+	GAMEPAD_BUTTON_STICK_RIGHT,
+
+	// Report byte 3
+	GAMEPAD_BUTTON_LB,
+	GAMEPAD_BUTTON_RB,
+	GAMEPAD_BUTTON_MENU,
+	GAMEPAD_BUTTON_UNUSED,
+	GAMEPAD_BUTTON_A,
+	GAMEPAD_BUTTON_B,
+	GAMEPAD_BUTTON_X,
+	GAMEPAD_BUTTON_Y,
+
+	// Virtual buttons
+	GAMEPAD_TRIGGER_LT,
+	GAMEPAD_TRIGGER_RT,
+	GAMEPAD_CHORD_FIRST, // One bit for every chord, e.g. L4 and R4
+
+	GAMEPAD_BUTTON_COUNT = GAMEPAD_CHORD_FIRST + CHORDS_MAX
+};
+
+// Button names in sysfs, only buttons with a name can be mapped
+static const char * const gamepad_button_names[GAMEPAD_CHORD_FIRST] = {
+	[GAMEPAD_DPAD_TOP]           = "dpad_up",
+	[GAMEPAD_DPAD_BOTTOM]        = "dpad_down",
+	[GAMEPAD_DPAD_LEFT]          = "dpad_left",
+	[GAMEPAD_DPAD_RIGHT]         = "dpad_right",
+	[GAMEPAD_BUTTON_PLUS]        = "plus",
+	[GAMEPAD_BUTTON_MINUS]       = "minus",
+	[GAMEPAD_BUTTON_STICK_LEFT]  = "stick_left",
+	[GAMEPAD_BUTTON_STICK_RIGHT] = "stick_right",
+	[GAMEPAD_BUTTON_LB]          = "lb",
+	[GAMEPAD_BUTTON_RB]          = "rb",
+	[GAMEPAD_BUTTON_MENU]        = "menu",
+	[GAMEPAD_BUTTON_A]           = "a",
+	[GAMEPAD_BUTTON_B]           = "b",
+	[GAMEPAD_BUTTON_X]           = "x",
+	[GAMEPAD_BUTTON_Y]           = "y",
+	[GAMEPAD_TRIGGER_LT]         = "lt",
+	[GAMEPAD_TRIGGER_RT]         = "rt",
+};
+
+#define GAMEPAD_MASK(button) BIT(GAMEPAD_##button)
+
+#define GAMEPAD_MASK_DPAD ( \
+	GAMEPAD_MASK(DPAD_TOP) | GAMEPAD_MASK(DPAD_BOTTOM) | \
+	GAMEPAD_MASK(DPAD_LEFT) | GAMEPAD_MASK(DPAD_RIGHT))
+
+// Experimental: L4 and R4 are programmed as a macro on the gamepad
+#define GAMEPAD_MACRO_L4 ( \
+	GAMEPAD_MASK(BUTTON_STICK_LEFT) | GAMEPAD_MASK(BUTTON_STICK_RIGHT) | \
+	GAMEPAD_MASK(BUTTON_MINUS))
+#define GAMEPAD_MACRO_R4 ( \
+	GAMEPAD_MASK(BUTTON_STICK_LEFT) | GAMEPAD_MASK(BUTTON_STICK_RIGHT) | \
+	GAMEPAD_MASK(BUTTON_PLUS))
+
+// Heartbeat to the kernel log (L + R + Plus + Minus)
+#define GAMEPAD_HEARTBEAT ( \
+	GAMEPAD_MASK(BUTTON_LB) | GAMEPAD_MASK(BUTTON_RB) | \
+	GAMEPAD_MASK(BUTTON_PLUS) | GAMEPAD_MASK(BUTTON_MINUS))
 
-	// Buttons
-	bool button_x;
-	bool button_y;
-	bool button_b;
-	bool button_a;
+// Default evdev code of every button bit
+// Bits without a code are not reported as keys.
+static const unsigned int gamepad_button_codes[GAMEPAD_CHORD_FIRST] = {
 
-	bool button_plus;
-	bool button_minus;
-	bool button_menu;
+	// Buttons on the right side
+	[GAMEPAD_BUTTON_A]           = BTN_A,
+	[GAMEPAD_BUTTON_B]           = BTN_B,
+	[GAMEPAD_BUTTON_X]           = BTN_Y, // X and Y
+	[GAMEPAD_BUTTON_Y]           = BTN_X, // need to be swapped
+
+	// Middle buttons
+	[GAMEPAD_BUTTON_PLUS]        = BTN_START,
+	[GAMEPAD_BUTTON_MINUS]       = BTN_SELECT,
+	[GAMEPAD_BUTTON_MENU]        = BTN_MODE,
 
 	// Shoulder buttons
-	bool button_lb;
-	bool button_rb;
-	bool button_l4; // Experimental, needs activation by macro
-	bool button_r4; // Experimental, needs activation by macro
+	[GAMEPAD_BUTTON_LB]          = BTN_TL,
+	[GAMEPAD_BUTTON_RB]          = BTN_TR,
+	[GAMEPAD_TRIGGER_LT]         = BTN_TL2,
+	[GAMEPAD_TRIGGER_RT]         = BTN_TR2,
 
 	// Stick buttons
-	bool button_stick_left;
-	bool button_stick_right;
+	[GAMEPAD_BUTTON_STICK_LEFT]  = BTN_THUMBL,
+	[GAMEPAD_BUTTON_STICK_RIGHT] = BTN_THUMBR,
+
+	// The D-Pad is reported as hat axes
+};
+
+// A chord of buttons reported as one more button
+// When all buttons of a chord are pressed, they are hidden and only the
+// chord is reported.
+struct gamepad_chord {
+	uint16_t buttons; // Bits 0-15 of enum gamepad_button
+	unsigned int code;
+};
+
+// Default chords
+// Experimental: L4 and R4 are programmed as a macro on the gamepad
+static const struct gamepad_chord gamepad_chords_u2c[] = {
+	{ GAMEPAD_MACRO_L4, BTN_TRIGGER_HAPPY1 }, // L4
+	{ GAMEPAD_MACRO_R4, BTN_TRIGGER_HAPPY2 }, // R4
+};
+
+// Chords that matched, found with one lookup
+struct gamepad_chord_match {
+	uint32_t set;   // Chord bits to set
+	uint16_t clear; // Buttons to hide
+};
+
+// Button mapping of one gamepad, compiled by gamepad_keymap_compile
+struct gamepad_keymap {
+	unsigned int codes[GAMEPAD_BUTTON_COUNT]; // Evdev code of every button bit
+	struct gamepad_chord chords[CHORDS_MAX];
+	unsigned int chord_count;
+
+	// The buttons used by chords packed into an index of chord_lut,
+	// one table for each report byte
+	uint8_t chord_index_low[256];
+	uint8_t chord_index_high[256];
+	struct gamepad_chord_match chord_lut[1 << CHORD_BUTTONS_MAX];
+};
+
+// Actions started by a combination of buttons
+enum gamepad_action_type {
+	GAMEPAD_ACTION_HEARTBEAT,       // Heartbeat to the kernel log
+	GAMEPAD_ACTION_TRIGGER_DIGITAL, // Switch the trigger mode
+	GAMEPAD_ACTION_TRIGGER_ANALOG,
+	GAMEPAD_ACTION_TRIGGER_BOTH,
+	GAMEPAD_ACTION_TRIGGER_NEXT,    // Digital, analog, both and over again
+	GAMEPAD_ACTION_TURBO,           // Turbo on and off
+	GAMEPAD_ACTION_COUNT
+};
+
+static const char * const gamepad_action_names[] = {
+	[GAMEPAD_ACTION_HEARTBEAT]       = "heartbeat",
+	[GAMEPAD_ACTION_TRIGGER_DIGITAL] = "trigger_digital",
+	[GAMEPAD_ACTION_TRIGGER_ANALOG]  = "trigger_analog",
+	[GAMEPAD_ACTION_TRIGGER_BOTH]    = "trigger_both",
+	[GAMEPAD_ACTION_TRIGGER_NEXT]    = "trigger_next",
+	[GAMEPAD_ACTION_TURBO]           = "turbo",
+};
+
+// An action runs once when all of its buttons get pressed. Holding them
+// does nothing more, it takes another press.
+struct gamepad_action {
+	uint32_t buttons; // Bits of enum gamepad_button below GAMEPAD_CHORD_FIRST
+	enum gamepad_action_type type;
+};
+
+// Default actions
+static const struct gamepad_action gamepad_actions_default[] = {
+	{ GAMEPAD_HEARTBEAT, GAMEPAD_ACTION_HEARTBEAT },
+};
+
+// Button, trigger and axis states
+struct gamepad_state {
 
-	// Direction-Pad
-	bool dpad_top;
-	bool dpad_right;
-	bool dpad_bottom;
-	bool dpad_left;
+	// Buttons, one bit per enum gamepad_button
+	uint32_t buttons;
+	uint32_t pressed; // Before the chords hid any, for the actions
 
 	// Shoulder trigger
 	uint8_t trigger_lt;
 	uint8_t trigger_rt;
-	bool trigger_lt_button;
-	bool trigger_rt_button;
 
 	// Axis
 	int16_t stick_left_x;
@@ -96,10 +384,317 @@ struct gamepad_state {
 	int16_t stick_right_y;
 };
 
+// Calibration of one stick
+struct gamepad_stick_calibration {
+
+	bool enabled; // False when every setting is neutral, skips all the math
+	bool axial;   // Dead zone per axis instead of around the center
+
+	unsigned int deadzone;      // Smaller deflections count as centered
+	unsigned int anti_deadzone; // Smallest deflection reported outside the dead zone
+	unsigned int outer;         // Deflections from here on count as full
+
+	// Response curve as given by the user, evenly spaced over the stick range
+	unsigned int curve_count;
+	uint16_t curve_points[CURVE_POINTS_MAX];
+
+	// Response curve as lookup table, interpolated between the entries
+	uint16_t curve[CURVE_LUT_SIZE];
+
+	// Smoothing of a resting stick over about this many reports, 0 = off
+	unsigned int filter;
+};
+
+// Filter of one axis, in 1/256 of the stick values
+struct gamepad_axis_filter {
+	s32 position;
+	s32 speed;  // Average change per report
+	s16 output; // Value last passed on
+};
+
+struct gamepad_stick_filter {
+	struct gamepad_axis_filter axis[2];
+	bool primed; // Starts on the first value
+	bool moving; // Not settled yet, identical reports have to go through
+};
+
+// Sticks
+enum gamepad_stick {
+	GAMEPAD_STICK_LEFT,
+	GAMEPAD_STICK_RIGHT,
+	GAMEPAD_STICK_COUNT
+};
+
+// One uploaded force feedback effect
+struct gamepad_ff_effect {
+	struct ff_effect effect;
+	bool playing;
+	unsigned int count; // Plays left, including the current one
+	ktime_t start; // Playback starts, after the delay
+	ktime_t stop;  // Playback ends, KTIME_MAX plays until stopped
+};
+
+struct gamepad;
+
+// Force feedback effect engine
+// Belongs to the ff core of the input device, which frees it. Everything is
+// protected by the event_lock of the input device.
+struct gamepad_ff {
+	struct gamepad *gamepad; // NULL once the gamepad is gone
+	struct input_dev *device;
+	struct hrtimer timer;
+	u16 gain;
+
+	// Motor bytes last sent
+	uint8_t strong;
+	uint8_t weak;
+
+	struct gamepad_ff_effect effects[FF_EFFECTS];
+};
+
+#ifdef GAMEPAD_LATENCY_STATS
+// Latency instrumentation, enabled with make LATENCY_STATS=1
+#define LATENCY_BUCKETS 32
+
+// Histogram with log2 sized buckets of nanoseconds
+// Bucket 0 counts 0 ns, bucket n counts 2^(n-1) to 2^n - 1 ns.
+struct gamepad_histogram {
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u32 buckets[LATENCY_BUCKETS];
+};
+
+struct gamepad_latency {
+	ktime_t completion;      // Completion of the report being processed
+	ktime_t last_completion; // Completion of the report before
+	struct gamepad_histogram processing; // URB completion to input_sync
+	struct gamepad_histogram interval;   // Between two URB completions
+};
+#endif
+
+// Statistics counters, shown in the statistics directory in sysfs
+struct gamepad_stats {
+	atomic_long_t in_packets;       // Completed input transfers
+	atomic_long_t in_short;         // Transfers shorter than a report
+	atomic_long_t in_unchanged;     // Reports identical to the one before
+	atomic_long_t in_unknown;       // Reports of a type other than 0x00
+	atomic_long_t in_stale;         // Reports overtaken by a newer one
+	atomic_long_t in_errors;        // Failed transfers, without unlinks
+	atomic_long_t in_link_errors;   // Failed transfers caused by the link
+	atomic_long_t in_submit_errors; // Failed input URB submissions
+	atomic_long_t in_starved;       // Completions with no URB left queued
+	atomic_long_t in_slowdowns;     // Times the polling slowed down while idle
+	atomic_long_t in_retries;       // Input URBs submitted again after an error
+	atomic_long_t in_recoveries;    // Input working again after errors
+	atomic_long_t halts;            // Stalled endpoints cleared
+	atomic_long_t out_packets;
+	atomic_long_t out_errors;
+	atomic_long_t out_submit_errors;
+	atomic_long_t rumble_requests;
+	atomic_long_t rumble_coalesced; // Replaced in the mailbox before sending
+	atomic_long_t rumble_unchanged; // Already on the motors, not sent
+	atomic_long_t rumble_delayed;   // Waited for the minimum interval
+	atomic_long_t rumble_dropped;   // Arrived while the gamepad was inactive
+	atomic_long_t raw_dropped;      // Lost because the raw device ring was full
+};
+
+#define gamepad_stat_inc(gamepad, name) atomic_long_inc(&(gamepad)->stats.name)
+
+// Offsets in the input report of one model
+struct gamepad_layout {
+	uint8_t buttons;    // Two bytes, bits in the order of enum gamepad_button
+	uint8_t trigger_lt;
+	uint8_t trigger_rt;
+	uint8_t sticks;     // Left X, left Y, right X, right Y, 16 bit little endian
+};
+
+// Everything that differs between the supported models
+struct gamepad_model {
+	const char *name;
+
+	// Input reports
+	uint8_t report_type; // Byte 0 of reports with the gamepad state
+	void (*decode)(const uint8_t *data, struct gamepad_state *state);
+	const struct gamepad_layout *layout; // What decode expects, the benchmark builds reports with it
+	const unsigned int *button_codes; // Default evdev code of every button bit
+	const struct gamepad_chord *chords; // Default chords
+	unsigned int chord_count;
+
+	// Rumble message, the motor values go to the given offsets
+	uint8_t rumble[8];
+	uint8_t rumble_size;
+	uint8_t rumble_strong;
+	uint8_t rumble_weak;
+
+	// Initialisation message
+	uint8_t welcome[8];
+	uint8_t welcome_size;
+};
+
+// Report decoders, one per layout
+static void gamepad_decode_u2c(const uint8_t *data, struct gamepad_state *state);
+
+static const struct gamepad_layout gamepad_layout_u2c = {
+	.buttons    = 2,
+	.trigger_lt = 4,
+	.trigger_rt = 5,
+	.sticks     = 6,
+};
+
+static const struct gamepad_model gamepad_model_u2c = {
+	.name = GAMEPAD_NAME,
+
+	.report_type  = 0x00,
+	.decode       = gamepad_decode_u2c,
+	.layout       = &gamepad_layout_u2c,
+	.button_codes = gamepad_button_codes,
+	.chords       = gamepad_chords_u2c,
+	.chord_count  = ARRAY_SIZE(gamepad_chords_u2c),
+
+	// The left motor has the heavy weight. I opened the gamepad to verify this.
+	// Byte 3 controls the left motor, byte 4 controls the right motor
+	.rumble        = { 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	.rumble_size   = 8,
+	.rumble_strong = 3,
+	.rumble_weak   = 4,
+
+	// Xbox Gamepad LED message
+	// The Ultimate 2C Wireless gamepad doesn't even have a programmable LED,
+	// it still requires this message in order to start working.
+	// Don't ask me why. Wild guess: The gamepad needs a "heartbeat" or any
+	// signal from the host to know it is there.
+	.welcome      = { 0x01, 0x03, 0x00 },
+	.welcome_size = 3,
+};
+
+// List all supported devices using vendor and product id
+static const struct usb_device_id module_device_table[] = {
+	// Vendor id: 0x2dc8 8bitdo
+	// Product id: 0x310a Ultimate 2C
+	{ USB_DEVICE(0x2dc8, 0x310a), .driver_info = (kernel_ulong_t)&gamepad_model_u2c },
+	{ }
+};
+
+// Output packets, prepared once and sent by gamepad_out_submit
+enum gamepad_out_packet {
+	GAMEPAD_OUT_RUMBLE,
+	GAMEPAD_OUT_WELCOME,
+	GAMEPAD_OUT_COUNT
+};
+
+struct gamepad_out_buffer {
+	uint8_t *data;
+	dma_addr_t dma;
+	uint8_t size;
+};
+
+// One slot of the input URB ring
+struct gamepad_in_slot {
+	struct gamepad *gamepad;
+	uint8_t *data;
+	dma_addr_t dma;
+	struct urb *urb;
+	uint32_t sequence;
+};
+
+// Raw report channel
+// The ring is mapped by user space, the header in the first page and the
+// entries right after it. The driver only writes head, the reader only
+// writes tail, both count up and wrap around.
+struct gamepad_raw_header {
+	__u32 entries;    // Ring size, a power of two
+	__u32 entry_size; // Size of struct gamepad_raw_entry
+	__u32 offset;     // Offset of the first entry in the mapping
+	__u32 reserved;
+	__u64 dropped;    // Reports lost because the ring was full
+	__u32 head __aligned(64); // Next entry the driver fills
+	__u32 tail __aligned(64); // Next entry the reader takes
+};
+
+struct gamepad_raw_entry {
+	__u64 timestamp; // Completion time in ns, CLOCK_MONOTONIC
+	__u32 sequence;  // Submission order of the URB
+	__u16 length;    // Bytes received
+	__u16 reserved;
+	__u8 data[PACKET_SIZE];
+};
+
+// State snapshot, the content of the state file in debugfs
+// The state as the input system got it, buttons in the bits of
+// enum gamepad_button.
+struct gamepad_snapshot {
+	__u64 timestamp;     // Completion time of the last report in ns, CLOCK_MONOTONIC
+	__u32 sequence;      // Submission order of its URB
+	__u32 buttons;
+	__s16 stick_left_x;
+	__s16 stick_left_y;
+	__s16 stick_right_x;
+	__s16 stick_right_y;
+	__u8 trigger_lt;
+	__u8 trigger_rt;
+	__u8 reserved[6];
+};
+
+// Raw device, outlives the gamepad while it is still open or mapped
+struct gamepad_raw {
+	struct kref kref;
+	struct miscdevice misc;
+	char name[32];
+	int id;
+	wait_queue_head_t wait;
+	bool gone; // The gamepad was disconnected
+	struct gamepad_raw_header *header;
+	struct gamepad_raw_entry *ring;
+	unsigned int entries;
+	size_t size; // Size of the whole mapping
+};
+
+// Streams of the benchmark, each one recording played in a loop
+enum gamepad_bench_stream {
+	GAMEPAD_BENCH_IDLE,    // Nothing touched, all reports the same
+	GAMEPAD_BENCH_STICKS,  // Both sticks going round in circles
+	GAMEPAD_BENCH_BUTTONS, // Other buttons pressed in every report
+	GAMEPAD_BENCH_CHORDS,  // The chords pressed and released in turns
+	GAMEPAD_BENCH_RUMBLE,  // Rumble requests faster than the output, self test only
+	GAMEPAD_BENCH_STREAM_COUNT
+};
+
+static const char * const gamepad_bench_stream_names[] = {
+	[GAMEPAD_BENCH_IDLE]    = "idle",
+	[GAMEPAD_BENCH_STICKS]  = "sticks",
+	[GAMEPAD_BENCH_BUTTONS] = "buttons",
+	[GAMEPAD_BENCH_CHORDS]  = "chords",
+	[GAMEPAD_BENCH_RUMBLE]  = "rumble",
+};
+
+// Result of the last benchmark run
+struct gamepad_bench {
+	bool valid;
+	unsigned int stream;
+	unsigned long packets;
+	unsigned long unchanged; // Skipped as identical to the report before
+	unsigned long events;    // Input events including the syncs
+	u64 ns;
+
+	// Rumble stream, the packets are the requests
+	unsigned long rumble_coalesced;
+	unsigned long rumble_unchanged;
+	unsigned long rumble_sent;
+};
+
 // Gamepad object
 struct gamepad {
 
 	bool active;
+	const struct gamepad_model *model;
+	struct list_head list; // Entry in gamepad_list
+
+	// Lifetime, output transfers still running after disconnect hold a
+	// reference. The last one frees the gamepad in release_work.
+	struct kref kref;
+	struct work_struct release_work;
 
 	// USB
 	struct usb_device *usb_device;
@@ -107,484 +702,4127 @@ struct gamepad {
 	struct usb_endpoint_descriptor *usb_endpoint_in;
 	struct usb_endpoint_descriptor *usb_endpoint_out;
 
+	// Settings, changed through sysfs
+	struct mutex config_lock;
+	unsigned int in_interval;  // 0 = endpoint descriptor
+	unsigned int out_interval; // 0 = endpoint descriptor
+	unsigned int trigger_mode;
+	int trigger_fuzz;
+	int trigger_flat;
+	unsigned int rumble_interval; // Milliseconds, read without a lock
+	unsigned int slow_after;      // Milliseconds, 0 = never
+	unsigned int slow_interval;   // Milliseconds
+
+	// Actions, changed under config_lock and usb_in_lock
+	struct gamepad_action actions[ACTIONS_MAX];
+	unsigned int action_count;
+	unsigned long actions_held;    // Actions whose buttons are all pressed
+	unsigned long actions_pending; // Waiting for action_work
+	struct work_struct action_work;
+
+	// Turbo, changed under config_lock and usb_in_lock
+	uint32_t turbo_buttons;                         // Buttons with a turbo rate
+	bool turbo_enabled;                             // Toggled by the turbo action
+	uint8_t turbo_rate[GAMEPAD_CHORD_FIRST];        // Presses per second
+	uint32_t turbo_held;                            // Turbo buttons held right now
+	ktime_t turbo_start[GAMEPAD_CHORD_FIRST];       // When they got pressed
+	struct hrtimer turbo_timer;                     // Fires at the next edge
+
+	// Stick calibration, used by the input callback under usb_in_lock
+	struct gamepad_stick_calibration stick_calibration[GAMEPAD_STICK_COUNT];
+	struct gamepad_stick_filter stick_filter[GAMEPAD_STICK_COUNT];
+
 	// Input device
-	bool input_device_active;
+	bool input_device_active; // Changed under usb_in_lock while the input runs
+	bool input_pending;       // Registered by input_work with the first report
+	struct work_struct input_work;
 	bool input_ff_active;
 	struct input_dev *input_device;
 	char input_path[64];
+	uint32_t input_keys; // Button bits reported as keys
+	struct gamepad_keymap keymap; // Changed only while the input is stopped
+
+	// Packet buffers of all URBs in one coherent block,
+	// the input slots first and the output packets last
+	uint8_t *usb_data;
+	dma_addr_t usb_dma;
 
 	// Data input
-	uint8_t *usb_in_data;
-	dma_addr_t usb_in_dma;
+	// A ring of URBs keeps the interrupt pipe busy while we process a report
+	struct gamepad_in_slot usb_in_slots[IN_URBS_MAX];
+	unsigned int usb_in_count;
 	spinlock_t usb_in_lock;
-	struct urb *usb_in_urb;
+	uint32_t usb_in_submitted; // Sequence number of the last submitted URB
+	uint32_t usb_in_delivered; // Sequence number of the last processed report
+	atomic_t usb_in_queued;    // URBs in the host controller queue
+	bool usb_in_running;       // Cleared by gamepad_in_stop, no more submissions
+
+	// Slow polling while idle. The URB callback keeps its URB back and
+	// slow_timer submits one now and then, until a report changes something.
+	ktime_t usb_in_changed;       // Last report that changed something
+	bool usb_in_slow;             // Changed under usb_in_lock
+	unsigned long usb_in_parked;  // Slots kept back
+	struct hrtimer slow_timer;
+
+	// Recovery after transfer errors, e.g. when the 2.4G link drops.
+	// The input device stays registered all the time.
+	struct delayed_work recover_work;
+	unsigned long usb_in_recover;  // Failed slots waiting for the recovery
+	atomic_t recover_attempts;     // Reset by the next good report
+	int recover_status;            // Error that started the recovery
+
+	// Completion of the report being processed, the input events get it
+	// as timestamp, minus usb_in_age
+	ktime_t usb_in_time;
+	ktime_t usb_in_age;
+
+	// Last processed report, identical reports are skipped right away
+	uint8_t usb_in_last[REPORT_SIZE];
+	bool usb_in_last_valid;
+
+	// Data output
+	struct gamepad_out_buffer usb_out[GAMEPAD_OUT_COUNT];
+	struct urb *usb_out_urb;
+	struct usb_anchor usb_out_anchor;
+	unsigned long usb_out_flags;
+
+	// Button, trigger and axis states
+	struct gamepad_state state;
+	// State last reported to the input system. Starts zeroed, just like a
+	// freshly registered input device with everything released and centered.
+	struct gamepad_state reported;
+
+	// Newest rumble request, waits here until the output is free
+	atomic_t rumble_mailbox;
+
+	// Motor values last sent and when, owned by GAMEPAD_OUT_BUSY
+	int rumble_sent;
+	ktime_t rumble_sent_at;
+	struct hrtimer rumble_timer; // Sends what waited for rumble_interval
+
+	// Power management
+	bool suspended;             // URBs are stopped until resume
+	struct work_struct pm_work; // Wakes the gamepad up for rumble
+
+	// Statistics
+	struct gamepad_stats stats;
+
+	// Raw report channel, filled under usb_in_lock
+	struct gamepad_raw *raw;
+
+	// State snapshot, written under usb_in_lock, read without any lock
+	seqcount_t snapshot_seq;
+	struct gamepad_snapshot snapshot;
+
+	// Debugging
+	struct dentry *debugfs_dir;
+	struct gamepad_bench bench; // Protected by config_lock
+#ifdef GAMEPAD_LATENCY_STATS
+	struct gamepad_latency latency; // Protected by usb_in_lock
+#endif
+
+};
+
+
+// Gamepad initialisation
+static int gamepad_probe(struct usb_interface *interface, const struct usb_device_id *id);
+static void gamepad_disconnect(struct usb_interface *interface);
+static void gamepad_cleanup(struct gamepad *gamepad);
+static void gamepad_release(struct kref *kref);
+static void gamepad_release_work(struct work_struct *work);
+
+// Power management
+static int gamepad_suspend(struct usb_interface *interface, pm_message_t message);
+static int gamepad_resume(struct usb_interface *interface);
+
+// Receiving messages
+static int gamepad_in_submit(struct gamepad *gamepad, struct gamepad_in_slot *slot);
+static int gamepad_in_start(struct gamepad *gamepad);
+static void gamepad_in_stop(struct gamepad *gamepad);
+static bool gamepad_in_park(struct gamepad *gamepad, struct gamepad_in_slot *slot, ktime_t now);
+static void gamepad_in_changed(struct gamepad *gamepad);
+static enum hrtimer_restart gamepad_slow_timer(struct hrtimer *timer);
+
+// Sending messages
+static int gamepad_out_start(struct gamepad *gamepad);
+static int gamepad_welcome_message(struct gamepad *gamepad);
+static void gamepad_rumble_message(struct gamepad *gamepad, uint16_t weak, uint16_t strong);
+static void gamepad_rumble_flush(struct gamepad *gamepad);
+
+// Callbacks for sending and receiving data
+static void gamepad_in_cb(struct urb *urb);
+static void gamepad_out_cb(struct urb *urb);
+
+// Turbo
+static void gamepad_turbo_apply(struct gamepad *gamepad, ktime_t now);
+static void gamepad_turbo_update(struct gamepad *gamepad);
+static enum hrtimer_restart gamepad_turbo_timer(struct hrtimer *timer);
+
+// Recovery after transfer errors
+static void gamepad_recover(struct gamepad *gamepad, int status);
+static void gamepad_recover_work(struct work_struct *work);
+
+// Input system initialisation
+static int gamepad_input_connect(struct gamepad *gamepad);
+static int gamepad_input_process(struct gamepad *gamepad, ktime_t time);
+static void gamepad_input_disconnect(struct gamepad *gamepad);
+static int gamepad_input_reconnect(struct gamepad *gamepad);
+static void gamepad_input_work(struct work_struct *work);
+
+// Actions
+static void gamepad_actions_match(struct gamepad *gamepad, uint32_t buttons);
+static void gamepad_action_work(struct work_struct *work);
+
+// Force feedback
+static int gamepad_ff_create(struct gamepad *gamepad);
+static void gamepad_ff_shutdown(struct input_dev *device);
+
+// Raw report channel
+static int gamepad_raw_create(struct gamepad *gamepad);
+static void gamepad_raw_destroy(struct gamepad *gamepad);
+static void gamepad_raw_push(struct gamepad *gamepad, const uint8_t *data, unsigned int length, uint32_t sequence, u64 timestamp);
+
+// Replay and benchmark
+static void gamepad_bench_debugfs(struct gamepad *gamepad);
+
+// State snapshot
+static void gamepad_snapshot_publish(struct gamepad *gamepad);
+static void gamepad_snapshot_debugfs(struct gamepad *gamepad);
+
+// Latency statistics, compiled in with make LATENCY_STATS=1
+#ifdef GAMEPAD_LATENCY_STATS
+static void gamepad_latency_completion(struct gamepad *gamepad);
+static void gamepad_latency_sync(struct gamepad *gamepad);
+static void gamepad_latency_debugfs(struct gamepad *gamepad);
+#else
+static inline void gamepad_latency_completion(struct gamepad *gamepad) { }
+static inline void gamepad_latency_sync(struct gamepad *gamepad) { }
+static inline void gamepad_latency_debugfs(struct gamepad *gamepad) { }
+#endif
+
+// Frees gamepads, drained when the module is unloaded
+static struct workqueue_struct *gamepad_wq;
+
+// Debugging in debugfs
+static struct dentry *gamepad_debugfs_root;
+
+// All gamepads bound to the driver
+static LIST_HEAD(gamepad_list);
+static DEFINE_MUTEX(gamepad_list_lock);
+
+// Numbers of the raw devices
+static DEFINE_IDA(gamepad_raw_ida);
+
+/******************************************************************************
+ * Code starts here
+ ******************************************************************************/
+
+// hrtimer_setup replaced hrtimer_init in Linux 6.13
+static void gamepad_hrtimer_setup(struct hrtimer *timer, enum hrtimer_restart (*function)(struct hrtimer *)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(timer, function, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	timer->function = function;
+#endif
+}
+
+/******************************************************************************
+ * Force feedback effects
+ ******************************************************************************/
+
+// The game wants the gamepad to rumble
+// Effects are played by the driver itself. Rumble, constant and periodic
+// effects with envelopes are mixed into the two motors. The timer only runs
+// when the motor bytes may change: at the start and end of an effect, at the
+// edges of a square wave, along an envelope and while sampling other waves.
+
+// Remember the earliest time something happens
+static void gamepad_ff_next(ktime_t *next, ktime_t time) {
+	if (ktime_before(time, *next))
+		*next = time;
+}
+
+// Linear change of a level between two points in time
+static int gamepad_ff_ramp(int from, int to, ktime_t begin, ktime_t end, ktime_t now, ktime_t *next) {
+	s64 length = ktime_us_delta(end, begin);
+	s64 elapsed = ktime_us_delta(now, begin);
+	int difference = to - from;
+	s64 step;
+
+	// Look again once the level has moved by about one motor byte
+	if (abs(difference) > FF_LEVEL_STEP) {
+		step = max_t(s64, div_s64(length * FF_LEVEL_STEP, abs(difference)), FF_STEP_MIN_US);
+		gamepad_ff_next(next, ktime_add_us(now, step));
+	}
+	gamepad_ff_next(next, end);
+
+	return from + div_s64(difference * elapsed, length);
+}
+
+// Level of an effect with envelope, 0 - 0x7fff
+static int gamepad_ff_envelope(const struct gamepad_ff_effect *ffe, const struct ff_envelope *envelope,
+		int level, ktime_t now, ktime_t *next) {
+	ktime_t begin;
+	ktime_t end;
+
+	level = min(abs(level), 0x7fff);
+
+	// Attack, from the attack level up to the effect level
+	end = ktime_add_ms(ffe->start, envelope->attack_length);
+	if (ktime_before(now, end))
+		return gamepad_ff_ramp(min_t(int, envelope->attack_level, 0x7fff), level,
+			ffe->start, end, now, next);
+
+	// Fade, from the effect level down to the fade level
+	if (envelope->fade_length && ffe->stop != KTIME_MAX) {
+		begin = ktime_sub_us(ffe->stop, envelope->fade_length * USEC_PER_MSEC);
+		if (!ktime_before(now, begin))
+			return gamepad_ff_ramp(level, min_t(int, envelope->fade_level, 0x7fff),
+				begin, ffe->stop, now, next);
+		gamepad_ff_next(next, begin);
+	}
+
+	return level;
+}
+
+// Wave at a position within the period (0 - 0xffff), -0x7fff - 0x7fff
+static int gamepad_ff_wave(u16 waveform, unsigned int position) {
+	switch (waveform) {
+	case FF_SQUARE:
+		return position < 0x8000 ? 0x7fff : -0x7fff;
+	case FF_TRIANGLE:
+		return position < 0x8000 ? position * 2 - 0x7fff : 0x7fff - (position - 0x8000) * 2;
+	case FF_SINE:
+		return fixp_sin16(position * 360 >> 16);
+	case FF_SAW_UP:
+		return max_t(int, position - 0x8000, -0x7fff);
+	case FF_SAW_DOWN:
+		return max_t(int, 0x7fff - position, -0x7fff);
+	default:
+		return 0;
+	}
+}
+
+// Strength of a periodic effect, 0 - 0x7fff
+static int gamepad_ff_periodic(const struct gamepad_ff_effect *ffe, ktime_t now, ktime_t *next) {
+	const struct ff_periodic_effect *periodic = &ffe->effect.u.periodic;
+	u32 period = periodic->period * USEC_PER_MSEC;
+	unsigned int position;
+	u32 time;
+	s64 step;
+	int level;
+	int value;
+
+	level = gamepad_ff_envelope(ffe, &periodic->envelope, periodic->magnitude, now, next);
+	if (periodic->magnitude < 0)
+		level = -level;
+
+	// Without a period the wave stands still
+	if (!period)
+		return min(abs(periodic->offset + level), 0x7fff);
+
+	// Position within the period, the phase shifts the wave
+	div_u64_rem(ktime_us_delta(now, ffe->start), period, &time);
+	position = (div_u64((u64)time << 16, period) + periodic->phase) & 0xffff;
+
+	value = periodic->offset + level * gamepad_ff_wave(periodic->waveform, position) / 0x7fff;
+
+	// A square only changes at its edges, other waves are sampled.
+	// Too small waves don't change the motor bytes at all.
+	if (abs(level) >= FF_LEVEL_STEP) {
+		if (periodic->waveform == FF_SQUARE)
+			step = div_u64((u64)(0x8000 - (position & 0x7fff)) * period, 0x10000) + 1;
+		else
+			step = period / FF_WAVE_STEPS;
+		gamepad_ff_next(next, ktime_add_us(now, max_t(s64, step, FF_STEP_MIN_US)));
+	}
+
+	return min(abs(value), 0x7fff);
+}
+
+static void gamepad_ff_start(struct gamepad_ff_effect *ffe, ktime_t now) {
+	ffe->playing = true;
+	ffe->start = ktime_add_ms(now, ffe->effect.replay.delay);
+	if (ffe->effect.replay.length)
+		ffe->stop = ktime_add_ms(ffe->start, ffe->effect.replay.length);
+	else
+		ffe->stop = KTIME_MAX;
+}
+
+// Work out the motor values, send them when the bytes changed, and set the
+// timer to the next time they may change. Called with event_lock held.
+static void gamepad_ff_update(struct gamepad_ff *ff, ktime_t now) {
+	struct gamepad_ff_effect *ffe;
+	ktime_t next = KTIME_MAX;
+	unsigned int strong = 0;
+	unsigned int weak = 0;
+	int level;
+	int i;
+
+	if (!ff->gamepad)
+		return;
+
+	for (i=0; i<FF_EFFECTS; i++) {
+		ffe = &ff->effects[i];
+		if (!ffe->playing)
+			continue;
+
+		// Done, starts over after the delay until all plays are used up
+		while (!ktime_before(now, ffe->stop) && --ffe->count)
+			gamepad_ff_start(ffe, ffe->stop);
+		if (!ktime_before(now, ffe->stop)) {
+			ffe->playing = false;
+			continue;
+		}
+
+		// Still waiting for the delay
+		if (ktime_before(now, ffe->start)) {
+			gamepad_ff_next(&next, ffe->start);
+			continue;
+		}
+		if (ffe->stop != KTIME_MAX)
+			gamepad_ff_next(&next, ffe->stop);
+
+		// Rumble drives the motors as they are,
+		// all other effects drive both motors the same
+		switch (ffe->effect.type) {
+		case FF_RUMBLE:
+			strong += ffe->effect.u.rumble.strong_magnitude;
+			weak += ffe->effect.u.rumble.weak_magnitude;
+			continue;
+		case FF_CONSTANT:
+			level = gamepad_ff_envelope(ffe, &ffe->effect.u.constant.envelope,
+				ffe->effect.u.constant.level, now, &next);
+			break;
+		case FF_PERIODIC:
+			level = gamepad_ff_periodic(ffe, now, &next);
+			break;
+		default:
+			continue;
+		}
+		strong += level * 2;
+		weak += level * 2;
+	}
+
+	strong = min(strong, 0xffffU) * ff->gain / 0xffff;
+	weak = min(weak, 0xffffU) * ff->gain / 0xffff;
+
+	// Motor bytes as sent by gamepad_rumble_message
+	if (strong / 256 != ff->strong || weak / 256 != ff->weak) {
+		ff->strong = strong / 256;
+		ff->weak = weak / 256;
+		gamepad_rumble_message(ff->gamepad, weak, strong);
+	}
+
+	if (next != KTIME_MAX)
+		hrtimer_start(&ff->timer, next, HRTIMER_MODE_ABS);
+	else
+		hrtimer_try_to_cancel(&ff->timer);
+}
+
+static enum hrtimer_restart gamepad_ff_timer(struct hrtimer *timer) {
+	struct gamepad_ff *ff = container_of(timer, struct gamepad_ff, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ff->device->event_lock, flags);
+	gamepad_ff_update(ff, ktime_get());
+	spin_unlock_irqrestore(&ff->device->event_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+// A new or changed effect, the ff core checked the type and waveform already
+static int gamepad_ff_upload(struct input_dev *device, struct ff_effect *effect, struct ff_effect *old) {
+	struct gamepad_ff *ff = device->ff->private;
+	struct gamepad_ff_effect *ffe = &ff->effects[effect->id];
+	ktime_t now = ktime_get();
+
+	spin_lock_irq(&device->event_lock);
+	ffe->effect = *effect;
+
+	// A playing effect starts over with the new settings
+	if (ffe->playing) {
+		gamepad_ff_start(ffe, now);
+		gamepad_ff_update(ff, now);
+	}
+	spin_unlock_irq(&device->event_lock);
+
+	return 0;
+}
+
+// Start or stop an effect, called with event_lock held
+static int gamepad_ff_playback(struct input_dev *device, int effect_id, int value) {
+	struct gamepad_ff *ff = device->ff->private;
+	struct gamepad_ff_effect *ffe = &ff->effects[effect_id];
+	ktime_t now = ktime_get();
+
+	// The value is how many times the effect plays
+	if (value > 0) {
+		ffe->count = value;
+		gamepad_ff_start(ffe, now);
+	}
+	else
+		ffe->playing = false;
+
+	gamepad_ff_update(ff, now);
+
+	return 0;
+}
+
+// Called with event_lock held
+static void gamepad_ff_set_gain(struct input_dev *device, u16 gain) {
+	struct gamepad_ff *ff = device->ff->private;
+
+	ff->gain = gain;
+	gamepad_ff_update(ff, ktime_get());
+}
+
+// The ff core goes away, possibly long after the gamepad
+static void gamepad_ff_destroy(struct ff_device *ff_device) {
+	struct gamepad_ff *ff = ff_device->private;
+
+	hrtimer_cancel(&ff->timer);
+}
+
+// Stop all effects for good, the gamepad is going away
+static void gamepad_ff_shutdown(struct input_dev *device) {
+	struct gamepad_ff *ff = device->ff->private;
+
+	spin_lock_irq(&device->event_lock);
+	if (ff->strong || ff->weak)
+		gamepad_rumble_message(ff->gamepad, 0, 0);
+	ff->gamepad = NULL;
+	spin_unlock_irq(&device->event_lock);
+
+	hrtimer_cancel(&ff->timer);
+}
+
+// Set up the effect engine of a new input device
+static int gamepad_ff_create(struct gamepad *gamepad) {
+	struct input_dev *device = gamepad->input_device;
+	struct gamepad_ff *ff;
+	int error;
+
+	ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+	if (!ff)
+		return -ENOMEM;
+	ff->gamepad = gamepad;
+	ff->device = device;
+	ff->gain = 0xffff;
+	gamepad_hrtimer_setup(&ff->timer, gamepad_ff_timer);
+
+	// Effects and waveforms we can play
+	input_set_capability(device, EV_FF, FF_RUMBLE);
+	input_set_capability(device, EV_FF, FF_CONSTANT);
+	input_set_capability(device, EV_FF, FF_PERIODIC);
+	input_set_capability(device, EV_FF, FF_SQUARE);
+	input_set_capability(device, EV_FF, FF_TRIANGLE);
+	input_set_capability(device, EV_FF, FF_SINE);
+	input_set_capability(device, EV_FF, FF_SAW_UP);
+	input_set_capability(device, EV_FF, FF_SAW_DOWN);
+	input_set_capability(device, EV_FF, FF_GAIN);
+
+	error = input_ff_create(device, FF_EFFECTS);
+	if (error) {
+		kfree(ff);
+		return error;
+	}
+
+	device->ff->private = ff;
+	device->ff->upload = gamepad_ff_upload;
+	device->ff->playback = gamepad_ff_playback;
+	device->ff->set_gain = gamepad_ff_set_gain;
+	device->ff->destroy = gamepad_ff_destroy;
+
+	return 0;
+}
+
+// Initialize the gamepad as input device
+static int gamepad_input_connect(struct gamepad *gamepad) {
+
+	int i;
+	int error;
+	struct input_dev *device;
+
+	// Create input device
+	device = input_allocate_device();
+	if (!device)
+		return -ENOMEM;
+	gamepad->input_device = device;
+
+	// Say my name!
+	device->name = gamepad->model->name;
+
+	if (gamepad->usb_device) {
+		// Setup a path to identify the gamepad
+		usb_make_path(gamepad->usb_device, gamepad->input_path, sizeof(gamepad->input_path));
+		strlcat(gamepad->input_path, "/input0", sizeof(gamepad->input_path));
+		device->phys = gamepad->input_path;
+
+		// Tell input device and USB about each other
+		usb_to_input_id(gamepad->usb_device, &device->id);
+
+		// Map it to the correct point in sysfs tree
+		device->dev.parent = &gamepad->usb_interface->dev;
+	}
+
+	// Map the gamepad to the input device
+	input_set_drvdata(device, gamepad);
+
+	// Enable force feedback
+	error = gamepad_ff_create(gamepad);
+	if (error)
+		return error;
+	gamepad->input_ff_active = true;
+
+	// Inform the input device about existing buttons, sticks, triggers
+	// Buttons, the same table is used when reporting
+	gamepad->input_keys = 0;
+	for (i=0; i<GAMEPAD_BUTTON_COUNT; i++) {
+		if (gamepad->keymap.codes[i])
+			gamepad->input_keys |= BIT(i);
+	}
+
+	// LT and RT as buttons are optional
+	if (gamepad->trigger_mode == GAMEPAD_TRIGGER_ANALOG)
+		gamepad->input_keys &= ~(GAMEPAD_MASK(TRIGGER_LT) | GAMEPAD_MASK(TRIGGER_RT));
+
+	for (i=0; i<GAMEPAD_BUTTON_COUNT; i++) {
+		if (gamepad->input_keys & BIT(i))
+			input_set_capability(device, EV_KEY, gamepad->keymap.codes[i]);
+	}
+
+	// D-Pad
+	// Assigned as axis rather than buttons on an Xbox layout
+	input_set_abs_params(device, ABS_HAT0X, -1, 1, 0, 0);
+	input_set_abs_params(device, ABS_HAT0Y, -1, 1, 0, 0);
+
+	// LT and RT as trigger
+	// Many games expect them as buttons, so this is optional
+	if (gamepad->trigger_mode != GAMEPAD_TRIGGER_DIGITAL) {
+		input_set_abs_params(device, ABS_Z, 0, 255, gamepad->trigger_fuzz, gamepad->trigger_flat);
+		input_set_abs_params(device, ABS_RZ, 0, 255, gamepad->trigger_fuzz, gamepad->trigger_flat);
+	}
+
+	// Sticks with axes
+	// Left
+	input_set_abs_params(device, ABS_X, -32768, 32767, 16, 128);
+	input_set_abs_params(device, ABS_Y, -32768, 32767, 16, 128);
+	// Right
+	input_set_abs_params(device, ABS_RX, -32768, 32767, 16, 128);
+	input_set_abs_params(device, ABS_RY, -32768, 32767, 16, 128);
+
+	// The self test has no USB device and keeps its input device to
+	// itself, nobody else may see the test reports. Events only need the
+	// buffer the registration would allocate, the release frees it.
+	if (!gamepad->usb_device) {
+		device->max_vals = GAMEPAD_BUTTON_COUNT + 10; // Keys, axes and syncs
+		device->vals = kcalloc(device->max_vals, sizeof(*device->vals), GFP_KERNEL);
+		if (!device->vals)
+			return -ENOMEM;
+	}
+
+	// Register device
+	else {
+		error = input_register_device(device);
+		if (error)
+			return -ENOMEM;
+	}
+
+	// The input ring may be running already
+	spin_lock_irq(&gamepad->usb_in_lock);
+	gamepad->input_device_active = true;
+	spin_unlock_irq(&gamepad->usb_in_lock);
+
+	return 0;
+}
+
+// Disconnect input device
+static void gamepad_input_disconnect(struct gamepad *gamepad) {
+
+	// The input device of the self test is never registered
+	bool registered = gamepad->input_device_active && gamepad->usb_device;
+
+	// Stop the effects first, the ff core may outlive the gamepad
+	if (gamepad->input_ff_active)
+		gamepad_ff_shutdown(gamepad->input_device);
+
+	// No more reports from the URB callback or turbo_timer. A timer
+	// callback running right now is done after the cancel.
+	if (gamepad->input_device_active) {
+		spin_lock_irq(&gamepad->usb_in_lock);
+		gamepad->input_device_active = false;
+		spin_unlock_irq(&gamepad->usb_in_lock);
+		hrtimer_cancel(&gamepad->turbo_timer);
+	}
+
+	// Unregister the input device when registered
+	if (registered) {
+
+		// Bye bye
+		// This also destroys FF and frees the input device
+		input_unregister_device(gamepad->input_device);
+		gamepad->input_ff_active = false;
+		gamepad->input_device = 0;
+	}
+
+	// Something went wrong when initializing the input device, or it
+	// belongs to the self test. We need some manual cleanup:
+	else {
+		// Only destroy FF when we do not call input_unregister_device
+		if (gamepad->input_ff_active) {
+			input_ff_destroy(gamepad->input_device);
+			gamepad->input_ff_active = false;
+		}
+
+		// Free the input device
+		if (gamepad->input_device) {
+			input_free_device(gamepad->input_device);
+			gamepad->input_device = 0;
+		}
+	}
+
+}
+
+// Create the input device again, e.g. when the capabilities changed
+// Called with config_lock held, the input ring is paused meanwhile.
+static int gamepad_input_reconnect(struct gamepad *gamepad) {
+	int error;
+
+	gamepad_in_stop(gamepad);
+	gamepad_input_disconnect(gamepad);
+
+	// The new input device starts with everything released
+	memset(&gamepad->reported, 0, sizeof(gamepad->reported));
+	gamepad->usb_in_last_valid = false;
+
+	error = gamepad_input_connect(gamepad);
+	if (error) {
+		log_err("Input device lost (%d)\n", error);
+		gamepad_input_disconnect(gamepad);
+		return error;
+	}
+
+	return gamepad_in_start(gamepad);
+}
+
+// Register the input device after the first report, see defer_input
+static void gamepad_input_work(struct work_struct *work) {
+	struct gamepad *gamepad = container_of(work, struct gamepad, input_work);
+	int error;
+
+	mutex_lock(&gamepad->config_lock);
+
+	// A new button map may have created it already
+	if (!gamepad->active || gamepad->input_device) {
+		mutex_unlock(&gamepad->config_lock);
+		return;
+	}
+
+	error = gamepad_input_connect(gamepad);
+	if (error) {
+		log_err_ratelimited("Creating the input device failed (%d)\n", error);
+		gamepad_input_disconnect(gamepad);
+
+		// The next report tries again
+		spin_lock_irq(&gamepad->usb_in_lock);
+		gamepad->input_pending = true;
+		spin_unlock_irq(&gamepad->usb_in_lock);
+	}
+	else {
+		// Buttons held right now, the reports may not change for a while
+		spin_lock_irq(&gamepad->usb_in_lock);
+		gamepad_input_process(gamepad, ktime_sub(gamepad->usb_in_time, gamepad->usb_in_age));
+		spin_unlock_irq(&gamepad->usb_in_lock);
+		log_info("Gamepad connected successfuly\n");
+	}
+
+	mutex_unlock(&gamepad->config_lock);
+}
+
+// Report an axis, but only when it changed since the last report
+static inline int gamepad_report_abs(struct input_dev *device, unsigned int code, int value, int reported) {
+	if (value == reported)
+		return 0;
+	input_report_abs(device, code, value);
+	return 1;
+}
+
+// Turn two D-Pad buttons into a hat axis value
+static inline int gamepad_dpad_axis(uint32_t buttons, unsigned int negative, unsigned int positive) {
+	return !!(buttons & BIT(positive)) - !!(buttons & BIT(negative));
+}
+
+// Process input from the gamepad, the events carry the given time
+// Only changes are passed to the input system. A packet without any change
+// does not produce a single event, not even a sync. Returns the number of
+// events sent.
+static int gamepad_input_process(struct gamepad *gamepad, ktime_t time) {
+
+	struct input_dev *device = gamepad->input_device;
+	struct gamepad_state *state = &gamepad->state;
+	struct gamepad_state *old = &gamepad->reported;
+	unsigned long changed;
+	unsigned long keys;
+	unsigned int bit;
+	int changes = 0;
+
+	if (gamepad->input_device_active) {
+
+		// Used by the next sync only, so it doesn't matter when nothing
+		// changed
+		input_set_timestamp(device, time);
+
+		// Buttons
+		changed = state->buttons ^ old->buttons;
+		keys = changed & gamepad->input_keys;
+		for_each_set_bit(bit, &keys, GAMEPAD_BUTTON_COUNT) {
+			input_report_key(device, gamepad->keymap.codes[bit], state->buttons & BIT(bit));
+			changes++;
+		}
+
+		// D-Pad
+		if (changed & GAMEPAD_MASK_DPAD) {
+			changes += gamepad_report_abs(device, ABS_HAT0X,
+				gamepad_dpad_axis(state->buttons, GAMEPAD_DPAD_LEFT, GAMEPAD_DPAD_RIGHT),
+				gamepad_dpad_axis(old->buttons, GAMEPAD_DPAD_LEFT, GAMEPAD_DPAD_RIGHT));
+			changes += gamepad_report_abs(device, ABS_HAT0Y,
+				gamepad_dpad_axis(state->buttons, GAMEPAD_DPAD_TOP, GAMEPAD_DPAD_BOTTOM),
+				gamepad_dpad_axis(old->buttons, GAMEPAD_DPAD_TOP, GAMEPAD_DPAD_BOTTOM));
+		}
+
+		// Sticks
+		changes += gamepad_report_abs(device, ABS_X, state->stick_left_x, old->stick_left_x);
+		changes += gamepad_report_abs(device, ABS_Y, -state->stick_left_y, -old->stick_left_y); // Y axis is mirrored
+		changes += gamepad_report_abs(device, ABS_RX, state->stick_right_x, old->stick_right_x);
+		changes += gamepad_report_abs(device, ABS_RY, -state->stick_right_y, -old->stick_right_y); // here too
+
+		// Triggers
+		if (gamepad->trigger_mode != GAMEPAD_TRIGGER_DIGITAL) {
+			changes += gamepad_report_abs(device, ABS_Z, state->trigger_lt, old->trigger_lt);
+			changes += gamepad_report_abs(device, ABS_RZ, state->trigger_rt, old->trigger_rt);
+		}
+
+		// Nothing changed, nothing to tell
+		if (!changes)
+			return 0;
+
+		trace_gamepad_state_change(gamepad->usb_device, state->buttons, changed,
+			state->stick_left_x, state->stick_left_y, state->stick_right_x, state->stick_right_y,
+			state->trigger_lt, state->trigger_rt);
+		input_sync(device);
+		trace_gamepad_input_sync(gamepad->usb_device, changes);
+		*old = *state;
+
+		// Someone is playing, the idle timeout starts over
+		if (gamepad->usb_device)
+			usb_mark_last_busy(gamepad->usb_device);
+	}
+
+	return changes;
+}
+
+// Number of events gamepad_input_process sends for a change, the sync
+// included. Follows the same rules, for the benchmark.
+static unsigned int gamepad_input_events(uint32_t keys, unsigned int trigger_mode,
+		const struct gamepad_state *state, const struct gamepad_state *old) {
+
+	uint32_t changed = state->buttons ^ old->buttons;
+	unsigned int events = hweight32(changed & keys);
+
+	if (changed & GAMEPAD_MASK_DPAD) {
+		events += gamepad_dpad_axis(state->buttons, GAMEPAD_DPAD_LEFT, GAMEPAD_DPAD_RIGHT) !=
+			gamepad_dpad_axis(old->buttons, GAMEPAD_DPAD_LEFT, GAMEPAD_DPAD_RIGHT);
+		events += gamepad_dpad_axis(state->buttons, GAMEPAD_DPAD_TOP, GAMEPAD_DPAD_BOTTOM) !=
+			gamepad_dpad_axis(old->buttons, GAMEPAD_DPAD_TOP, GAMEPAD_DPAD_BOTTOM);
+	}
+
+	events += state->stick_left_x != old->stick_left_x;
+	events += state->stick_left_y != old->stick_left_y;
+	events += state->stick_right_x != old->stick_right_x;
+	events += state->stick_right_y != old->stick_right_y;
+
+	if (trigger_mode != GAMEPAD_TRIGGER_DIGITAL) {
+		events += state->trigger_lt != old->trigger_lt;
+		events += state->trigger_rt != old->trigger_rt;
+	}
+
+	return events ? events + 1 : 0;
+}
+
+// Queue an input URB at the end of the ring
+static int gamepad_in_submit(struct gamepad *gamepad, struct gamepad_in_slot *slot) {
+	unsigned long flags;
+	int error;
+
+	// Numbering and submitting under the lock keeps the sequence numbers
+	// in the same order as the URBs in the host controller queue
+	spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+
+	// Stopped, the URB stays where it is
+	if (!gamepad->usb_in_running) {
+		spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+		return -ESHUTDOWN;
+	}
+
+	slot->sequence = ++gamepad->usb_in_submitted;
+
+	// Counted before submitting, the completion may run before
+	// usb_submit_urb returns
+	atomic_inc(&gamepad->usb_in_queued);
+	error = usb_submit_urb(slot->urb, GFP_ATOMIC);
+	if (error)
+		atomic_dec(&gamepad->usb_in_queued);
+	spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+
+	if (error)
+		gamepad_stat_inc(gamepad, in_submit_errors);
+
+	return error;
+}
+
+// Polling period of an URB in microseconds, as scheduled by the host controller
+static unsigned int gamepad_urb_period_us(struct gamepad *gamepad, struct urb *urb) {
+	if (gamepad->usb_device->speed >= USB_SPEED_HIGH)
+		return urb->interval * 125; // Microframes
+	return urb->interval * 1000; // Frames
+}
+
+// Prepare all input URBs, an interval of 0 uses the endpoint descriptor
+static void gamepad_in_fill(struct gamepad *gamepad, unsigned int interval) {
+	int i;
+
+	if (!interval)
+		interval = gamepad->usb_endpoint_in->bInterval;
+
+	for (i=0; i<gamepad->usb_in_count; i++) {
+		struct gamepad_in_slot *slot = &gamepad->usb_in_slots[i];
+		usb_fill_int_urb(slot->urb, gamepad->usb_device,
+				 usb_rcvintpipe(gamepad->usb_device, gamepad->usb_endpoint_in->bEndpointAddress),
+				 slot->data, PACKET_SIZE,
+				 gamepad_in_cb, slot,
+				 interval);
+		slot->urb->transfer_dma = slot->dma;
+		slot->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+}
+
+// Submit the whole input ring
+static int gamepad_in_submit_all(struct gamepad *gamepad) {
+	int i;
+	int error;
+
+	// Nothing left for the recovery, nothing kept back, full speed
+	xchg(&gamepad->usb_in_recover, 0);
+	spin_lock_irq(&gamepad->usb_in_lock);
+	gamepad->usb_in_running = true;
+	gamepad->usb_in_parked = 0;
+	gamepad->usb_in_slow = false;
+	gamepad->usb_in_changed = ktime_get();
+	spin_unlock_irq(&gamepad->usb_in_lock);
+
+	for (i=0; i<gamepad->usb_in_count; i++) {
+		error = gamepad_in_submit(gamepad, &gamepad->usb_in_slots[i]);
+		if (error) {
+			gamepad_in_stop(gamepad);
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+// Start receiving input
+static int gamepad_in_start(struct gamepad *gamepad) {
+	int error;
+
+	gamepad_in_fill(gamepad, gamepad->in_interval);
+	error = gamepad_in_submit_all(gamepad);
+
+	// The host controller does not like our interval, use the descriptor
+	if (error == -EINVAL && gamepad->in_interval) {
+		log_err("Input interval %u rejected, falling back to %u\n",
+			gamepad->in_interval, gamepad->usb_endpoint_in->bInterval);
+		gamepad->in_interval = 0;
+		gamepad_in_fill(gamepad, 0);
+		error = gamepad_in_submit_all(gamepad);
+	}
+
+	if (error) {
+		log_err("Starting input failed (%d)\n", error);
+		return error;
+	}
+
+	// A report can be taken anywhere in the polling period
+	spin_lock_irq(&gamepad->usb_in_lock);
+	gamepad->usb_in_age = 0;
+	if (timestamp_adjust)
+		gamepad->usb_in_age = ns_to_ktime(gamepad_urb_period_us(gamepad, gamepad->usb_in_slots[0].urb) * NSEC_PER_USEC / 2);
+	spin_unlock_irq(&gamepad->usb_in_lock);
+
+	log_info("Input polling every %u us\n",
+		gamepad_urb_period_us(gamepad, gamepad->usb_in_slots[0].urb));
+
+	return 0;
+}
+
+// Stop receiving input, waits for running callbacks
+static void gamepad_in_stop(struct gamepad *gamepad) {
+	int i;
+
+	// Neither the callbacks nor slow_timer submit anything after this
+	spin_lock_irq(&gamepad->usb_in_lock);
+	gamepad->usb_in_running = false;
+	spin_unlock_irq(&gamepad->usb_in_lock);
+	hrtimer_cancel(&gamepad->slow_timer);
+	hrtimer_cancel(&gamepad->turbo_timer);
+
+	for (i=0; i<gamepad->usb_in_count; i++)
+		usb_kill_urb(gamepad->usb_in_slots[i].urb);
+}
+
+// Keep the URB of a slot back when nothing changed for slow_after
+// slow_timer submits one kept back URB every slow_interval instead, the
+// host controller polls the gamepad that much less.
+static bool gamepad_in_park(struct gamepad *gamepad, struct gamepad_in_slot *slot, ktime_t now) {
+	unsigned int after = READ_ONCE(gamepad->slow_after);
+	unsigned long flags;
+	bool park;
+
+	if (!after)
+		return false;
+
+	spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+	park = gamepad->usb_in_running && ktime_after(now, ktime_add_ms(gamepad->usb_in_changed, after));
+	if (park) {
+		set_bit(slot - gamepad->usb_in_slots, &gamepad->usb_in_parked);
+		if (!gamepad->usb_in_slow) {
+			gamepad->usb_in_slow = true;
+			gamepad_stat_inc(gamepad, in_slowdowns);
+			hrtimer_start(&gamepad->slow_timer, ms_to_ktime(READ_ONCE(gamepad->slow_interval)), HRTIMER_MODE_REL);
+		}
+	}
+	spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+
+	return park;
+}
+
+// A report changed something, back to full speed
+// Called with usb_in_lock held, slow_timer submits the kept back URBs
+static void gamepad_in_changed(struct gamepad *gamepad) {
+	gamepad->usb_in_changed = gamepad->usb_in_time;
+	if (gamepad->usb_in_slow) {
+		gamepad->usb_in_slow = false;
+		hrtimer_start(&gamepad->slow_timer, 0, HRTIMER_MODE_REL);
+	}
+}
+
+// Submit one kept back URB while slow, all of them after a change
+// usb_in_slow is checked and the timer moved on under usb_in_lock, the
+// lock gamepad_in_changed starts the timer under. Once a change started it,
+// this never moves it, and a running callback only ends without a restart.
+static enum hrtimer_restart gamepad_slow_timer(struct hrtimer *timer) {
+	struct gamepad *gamepad = container_of(timer, struct gamepad, slow_timer);
+	unsigned long flags;
+	unsigned int i;
+	bool slow;
+
+	if (!gamepad->active || gamepad->suspended)
+		return HRTIMER_NORESTART;
+
+	spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+	slow = gamepad->usb_in_slow;
+	if (slow)
+		hrtimer_forward_now(timer, ms_to_ktime(READ_ONCE(gamepad->slow_interval)));
+	spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+
+	for (i=0; i<gamepad->usb_in_count; i++) {
+		if (test_and_clear_bit(i, &gamepad->usb_in_parked)) {
+			gamepad_in_submit(gamepad, &gamepad->usb_in_slots[i]);
+			if (slow)
+				break;
+		}
+	}
+
+	return slow ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+// Build the lookup table of the response curve from the curve points
+static void gamepad_calibration_update(struct gamepad_stick_calibration *calibration) {
+	unsigned int i;
+	unsigned int segments = calibration->curve_count - 1;
+	bool linear = true;
+
+	for (i=0; i<CURVE_LUT_SIZE; i++) {
+		// Position on the curve, in steps of the table
+		unsigned int position = i * segments;
+		unsigned int segment = position / CURVE_LUT_STEPS;
+		unsigned int fraction = position % CURVE_LUT_STEPS;
+		int from = calibration->curve_points[segment];
+		int to = segment < segments ? calibration->curve_points[segment + 1] : from;
+
+		calibration->curve[i] = from + (to - from) * (int)fraction / CURVE_LUT_STEPS;
+	}
+
+	// A straight line from 0 to the maximum changes nothing
+	for (i=1; i<segments; i++) {
+		if (calibration->curve_points[i] != STICK_MAX * i / segments)
+			linear = false;
+	}
+	if (calibration->curve_points[0] != 0 || calibration->curve_points[segments] != STICK_MAX)
+		linear = false;
+
+	calibration->enabled = !linear
+		|| calibration->deadzone
+		|| calibration->anti_deadzone
+		|| calibration->outer < STICK_MAX;
+}
+
+// Neutral calibration, passes the stick values as they are
+static void gamepad_calibration_reset(struct gamepad_stick_calibration *calibration) {
+	memset(calibration, 0, sizeof(*calibration));
+	calibration->outer = STICK_MAX;
+	calibration->curve_count = 2;
+	calibration->curve_points[1] = STICK_MAX;
+	gamepad_calibration_update(calibration);
+}
+
+// Apply dead zone, outer limit, response curve and anti dead zone
+// to the deflection of a stick (0 to STICK_MAX)
+static unsigned int gamepad_calibrate(const struct gamepad_stick_calibration *calibration, unsigned int deflection) {
+	unsigned int index;
+	unsigned int fraction;
+	int from;
+	int to;
+
+	if (deflection <= calibration->deadzone)
+		return 0;
+
+	// Full deflection, end of the response curve
+	if (deflection >= calibration->outer) {
+		deflection = calibration->curve[CURVE_LUT_STEPS];
+	}
+
+	// Stretch the range between dead zone and outer limit
+	// and look it up on the response curve
+	else {
+		deflection = (deflection - calibration->deadzone) * (STICK_MAX + 1)
+			/ (calibration->outer - calibration->deadzone);
+
+		index = deflection >> CURVE_LUT_SHIFT;
+		fraction = deflection & ((1 << CURVE_LUT_SHIFT) - 1);
+		from = calibration->curve[index];
+		to = calibration->curve[index + 1];
+		deflection = from + (((to - from) * (int)fraction) >> CURVE_LUT_SHIFT);
+	}
+
+	// Anti dead zone, skip the part of the range where games
+	// apply their own dead zone
+	return calibration->anti_deadzone
+		+ deflection * (STICK_MAX - calibration->anti_deadzone) / STICK_MAX;
+}
+
+// Calibrate a single axis
+static int16_t gamepad_calibrate_axis(const struct gamepad_stick_calibration *calibration, int16_t value) {
+	unsigned int deflection = min_t(unsigned int, abs(value), STICK_MAX);
+
+	deflection = gamepad_calibrate(calibration, deflection);
+	return value < 0 ? -(int)deflection : (int)deflection;
+}
+
+// Calibrate both axes of a stick
+static void gamepad_calibrate_stick(const struct gamepad_stick_calibration *calibration, int16_t *x, int16_t *y) {
+	unsigned int deflection;
+	unsigned int calibrated;
+
+	// Nothing to do
+	if (!calibration->enabled)
+		return;
+
+	// Dead zone for each axis on its own
+	if (calibration->axial) {
+		*x = gamepad_calibrate_axis(calibration, *x);
+		*y = gamepad_calibrate_axis(calibration, *y);
+		return;
+	}
+
+	// Dead zone around the center, keeps the direction of the stick
+	deflection = int_sqrt((unsigned long)(*x * *x) + (unsigned long)(*y * *y));
+	if (!deflection)
+		return;
+
+	calibrated = gamepad_calibrate(calibration, min_t(unsigned int, deflection, STICK_MAX));
+	*x = clamp_t(int, *x * (int)calibrated / (int)deflection, -STICK_MAX - 1, STICK_MAX);
+	*y = clamp_t(int, *y * (int)calibrated / (int)deflection, -STICK_MAX - 1, STICK_MAX);
+}
+
+// Smooth one axis
+// An exponential average that follows faster the faster the stick moves,
+// like the One Euro filter. A resting stick gets averaged over about
+// calibration->filter reports, a moving one lags behind much less. There is
+// no overshoot. The output stays while the changes are below FILTER_HOLD.
+static int16_t gamepad_filter_axis(const struct gamepad_stick_calibration *calibration,
+		struct gamepad_axis_filter *filter, int16_t value, bool *moving) {
+
+	s32 input = value * 256;
+	s32 distance = abs(input - filter->position);
+	s32 weight;
+
+	// Speed in steps per report, averaged over two reports
+	filter->speed = (filter->speed + distance) / 2;
+
+	// Share of the distance taken, 1 = 256 * FILTER_SPEED
+	weight = FILTER_SPEED * 256 + filter->speed;
+	filter->position += div_s64((s64)(input - filter->position) * weight,
+		weight + calibration->filter * FILTER_SPEED * 256);
+
+	// Close enough, stop right on the input
+	if (abs(input - filter->position) < 256) {
+		filter->position = input;
+		filter->speed = 0;
+	}
+	else
+		*moving = true;
+
+	// Slow and close, noise most likely
+	if (filter->speed < FILTER_SPEED * 256 &&
+			abs(DIV_ROUND_CLOSEST(filter->position, 256) - filter->output) < FILTER_HOLD)
+		return filter->output;
+
+	filter->output = clamp_t(s32, DIV_ROUND_CLOSEST(filter->position, 256), -STICK_MAX - 1, STICK_MAX);
+	return filter->output;
+}
+
+static void gamepad_filter_stick(const struct gamepad_stick_calibration *calibration,
+		struct gamepad_stick_filter *filter, int16_t *x, int16_t *y) {
+
+	// Nothing to do
+	if (!calibration->filter)
+		return;
+
+	if (!filter->primed) {
+		filter->axis[0] = (struct gamepad_axis_filter){ .position = *x * 256, .output = *x };
+		filter->axis[1] = (struct gamepad_axis_filter){ .position = *y * 256, .output = *y };
+		filter->primed = true;
+	}
+
+	filter->moving = false;
+	*x = gamepad_filter_axis(calibration, &filter->axis[0], *x, &filter->moving);
+	*y = gamepad_filter_axis(calibration, &filter->axis[1], *y, &filter->moving);
+}
+
+// Build the chord lookup
+// The buttons used by any chord are packed into an index of up to
+// CHORD_BUTTONS_MAX bits. The entry of every combination says which chords
+// are on and which buttons they hide.
+static int gamepad_keymap_compile(struct gamepad_keymap *keymap) {
+	uint8_t index_bit[16];
+	uint16_t used = 0;
+	unsigned int count = 0;
+	unsigned int index;
+	unsigned int value;
+	unsigned int i;
+	unsigned int bit;
+
+	for (i=0; i<keymap->chord_count; i++)
+		used |= keymap->chords[i].buttons;
+
+	// Index bit of every chord button
+	for (bit=0; bit<16; bit++) {
+		if (!(used & BIT(bit)))
+			continue;
+		if (count == CHORD_BUTTONS_MAX)
+			return -EINVAL;
+		index_bit[bit] = count++;
+	}
+
+	// Index bits of every report byte value
+	for (value=0; value<256; value++) {
+		keymap->chord_index_low[value] = 0;
+		keymap->chord_index_high[value] = 0;
+		for (bit=0; bit<8; bit++) {
+			if ((used & BIT(bit)) && (value & BIT(bit)))
+				keymap->chord_index_low[value] |= BIT(index_bit[bit]);
+			if ((used & BIT(bit + 8)) && (value & BIT(bit)))
+				keymap->chord_index_high[value] |= BIT(index_bit[bit + 8]);
+		}
+	}
+
+	// Chords of every combination of chord buttons
+	memset(keymap->chord_lut, 0, sizeof(keymap->chord_lut));
+	for (index=0; index<BIT(count); index++) {
+		struct gamepad_chord_match *match = &keymap->chord_lut[index];
+		uint16_t buttons = 0;
+
+		for (bit=0; bit<16; bit++) {
+			if ((used & BIT(bit)) && (index & BIT(index_bit[bit])))
+				buttons |= BIT(bit);
+		}
+		for (i=0; i<keymap->chord_count; i++) {
+			if ((buttons & keymap->chords[i].buttons) == keymap->chords[i].buttons) {
+				match->set |= BIT(GAMEPAD_CHORD_FIRST + i);
+				match->clear |= keymap->chords[i].buttons;
+			}
+		}
+	}
+
+	// Codes of the chord bits
+	for (i=0; i<CHORDS_MAX; i++)
+		keymap->codes[GAMEPAD_CHORD_FIRST + i] = i < keymap->chord_count ? keymap->chords[i].code : 0;
+
+	return 0;
+}
+
+// Default button codes of the model
+static void gamepad_keymap_default_buttons(struct gamepad_keymap *keymap, const struct gamepad_model *model) {
+	memcpy(keymap->codes, model->button_codes, GAMEPAD_CHORD_FIRST * sizeof(*keymap->codes));
+}
+
+// Default chords of the model
+static void gamepad_keymap_default_chords(struct gamepad_keymap *keymap, const struct gamepad_model *model) {
+	keymap->chord_count = min_t(unsigned int, model->chord_count, CHORDS_MAX);
+	memcpy(keymap->chords, model->chords, keymap->chord_count * sizeof(*keymap->chords));
+}
+
+// Default actions
+static void gamepad_actions_default_set(struct gamepad *gamepad) {
+	gamepad->action_count = ARRAY_SIZE(gamepad_actions_default);
+	memcpy(gamepad->actions, gamepad_actions_default, sizeof(gamepad_actions_default));
+}
+
+// Find the actions whose buttons just got pressed
+// Called with usb_in_lock held. One compare per action, the actions run
+// later in action_work, they have no place in the URB callback.
+static void gamepad_actions_match(struct gamepad *gamepad, uint32_t buttons) {
+	const struct gamepad_action *action = gamepad->actions;
+	unsigned long matched = 0;
+	unsigned long pressed;
+	unsigned int i;
+
+	for (i=0; i<gamepad->action_count; i++) {
+		if ((buttons & action[i].buttons) == action[i].buttons)
+			matched |= BIT(i);
+	}
+
+	pressed = matched & ~gamepad->actions_held;
+	gamepad->actions_held = matched;
+	if (pressed) {
+		gamepad->actions_pending |= pressed;
+		schedule_work(&gamepad->action_work);
+	}
+}
+
+// Switch the trigger mode, the input device is created again
+// Called with config_lock held and the gamepad awake
+static void gamepad_action_trigger_mode(struct gamepad *gamepad, unsigned int mode) {
+
+	if (gamepad->trigger_mode == mode)
+		return;
+
+	gamepad->trigger_mode = mode;
+	if (!gamepad_input_reconnect(gamepad))
+		log_info("Trigger mode %s\n", gamepad_trigger_mode_names[mode]);
+}
+
+// Run the actions found by gamepad_actions_match
+static void gamepad_action_work(struct work_struct *work) {
+	struct gamepad *gamepad = container_of(work, struct gamepad, action_work);
+	unsigned long pending;
+	unsigned int i;
+
+	// Awake before config_lock, suspend waits for recover_work which
+	// takes the lock too
+	if (usb_autopm_get_interface(gamepad->usb_interface))
+		return;
+	mutex_lock(&gamepad->config_lock);
+
+	spin_lock_irq(&gamepad->usb_in_lock);
+	pending = gamepad->actions_pending;
+	gamepad->actions_pending = 0;
+	spin_unlock_irq(&gamepad->usb_in_lock);
+
+	// The action list only changes under config_lock
+	for_each_set_bit(i, &pending, ACTIONS_MAX) {
+		if (!gamepad->active)
+			break;
+
+		switch (gamepad->actions[i].type) {
+		case GAMEPAD_ACTION_HEARTBEAT:
+			log_info("Heartbeat! (L + R + Plus + Minus)\n");
+			break;
+		case GAMEPAD_ACTION_TRIGGER_DIGITAL:
+			gamepad_action_trigger_mode(gamepad, GAMEPAD_TRIGGER_DIGITAL);
+			break;
+		case GAMEPAD_ACTION_TRIGGER_ANALOG:
+			gamepad_action_trigger_mode(gamepad, GAMEPAD_TRIGGER_ANALOG);
+			break;
+		case GAMEPAD_ACTION_TRIGGER_BOTH:
+			gamepad_action_trigger_mode(gamepad, GAMEPAD_TRIGGER_BOTH);
+			break;
+		case GAMEPAD_ACTION_TRIGGER_NEXT:
+			gamepad_action_trigger_mode(gamepad, (gamepad->trigger_mode + 1) % GAMEPAD_TRIGGER_MODE_COUNT);
+			break;
+		case GAMEPAD_ACTION_TURBO:
+			gamepad->turbo_enabled = !gamepad->turbo_enabled;
+			gamepad_turbo_update(gamepad);
+			log_info("Turbo %s\n", gamepad->turbo_enabled ? "on" : "off");
+			break;
+		default:
+			break;
+		}
+	}
+
+	mutex_unlock(&gamepad->config_lock);
+	usb_autopm_put_interface(gamepad->usb_interface);
+}
+
+// Decode a report with a fixed layout
+// Always inlined with a constant layout, every model gets a decoder with
+// the offsets built in.
+static __always_inline void gamepad_decode_layout(const struct gamepad_layout *layout,
+		const uint8_t *data, struct gamepad_state *state) {
+
+	// Buttons, bits 0-15 are taken straight from the report
+	state->buttons = data[layout->buttons] | (data[layout->buttons + 1] << 8);
+
+	// Trigger
+	state->trigger_lt = data[layout->trigger_lt];
+	state->trigger_rt = data[layout->trigger_rt];
+
+	// Axis
+	state->stick_left_x  = (data[layout->sticks + 1]<<8) + data[layout->sticks];
+	state->stick_left_y  = (data[layout->sticks + 3]<<8) + data[layout->sticks + 2];
+	state->stick_right_x = (data[layout->sticks + 5]<<8) + data[layout->sticks + 4];
+	state->stick_right_y = (data[layout->sticks + 7]<<8) + data[layout->sticks + 6];
+}
+
+static void gamepad_decode_u2c(const uint8_t *data, struct gamepad_state *state) {
+	gamepad_decode_layout(&gamepad_layout_u2c, data, state);
+}
+
+// Turn a report into the state reported to the input system
+// No side effects besides the state and the stick filters. The previous
+// state is only needed for the trigger hysteresis. The report has to be of
+// the type of the model.
+static void gamepad_report_parse(const struct gamepad_model *model,
+		const struct gamepad_stick_calibration *calibration, struct gamepad_stick_filter *filter,
+		const struct gamepad_keymap *keymap, const uint8_t *data, struct gamepad_state *state) {
+
+	const struct gamepad_chord_match *chord;
+	uint32_t buttons;
+	uint32_t triggers;
+
+	// The trigger buttons keep their old state between the thresholds
+	triggers = state->buttons & (GAMEPAD_MASK(TRIGGER_LT) | GAMEPAD_MASK(TRIGGER_RT));
+
+	model->decode(data, state);
+	buttons = state->buttons | triggers;
+
+	// Virtual buttons from triggers
+	if (state->trigger_lt < 16)
+		buttons &= ~GAMEPAD_MASK(TRIGGER_LT);
+	else if (state->trigger_lt > 32)
+		buttons |= GAMEPAD_MASK(TRIGGER_LT);
+	if (state->trigger_rt < 16)
+		buttons &= ~GAMEPAD_MASK(TRIGGER_RT);
+	else if (state->trigger_rt > 32)
+		buttons |= GAMEPAD_MASK(TRIGGER_RT);
+	state->pressed = buttons;
+
+	// Smoothing, the dead zones see the filtered values
+	gamepad_filter_stick(&calibration[GAMEPAD_STICK_LEFT], &filter[GAMEPAD_STICK_LEFT],
+		&state->stick_left_x, &state->stick_left_y);
+	gamepad_filter_stick(&calibration[GAMEPAD_STICK_RIGHT], &filter[GAMEPAD_STICK_RIGHT],
+		&state->stick_right_x, &state->stick_right_y);
+
+	// Dead zones and response curves
+	gamepad_calibrate_stick(&calibration[GAMEPAD_STICK_LEFT],
+		&state->stick_left_x, &state->stick_left_y);
+	gamepad_calibrate_stick(&calibration[GAMEPAD_STICK_RIGHT],
+		&state->stick_right_x, &state->stick_right_y);
+
+	// Chords, e.g. the experimental shoulder buttons L4 and R4
+	// One lookup, no matter how many chords there are
+	chord = &keymap->chord_lut[keymap->chord_index_low[buttons & 0xff] |
+		keymap->chord_index_high[(buttons >> 8) & 0xff]];
+	buttons = (buttons & ~(uint32_t)chord->clear) | chord->set;
+
+	state->buttons = buttons;
+}
+
+// Decode a report and pass it on to the input system
+// Called with usb_in_lock held. Returns the number of events sent, as
+// gamepad_input_process.
+static int gamepad_in_report(struct gamepad *gamepad, const uint8_t *data) {
+	struct gamepad_state *state = &gamepad->state;
+	int changes;
+
+	if (data[0] != gamepad->model->report_type) {
+		gamepad_stat_inc(gamepad, in_unknown);
+		return 0;
+	}
+
+	// The gamepad is there, time for the input device
+	if (gamepad->input_pending) {
+		gamepad->input_pending = false;
+		schedule_work(&gamepad->input_work);
+	}
+
+	// Most reports are exactly the same as the one before,
+	// e.g. whenever the sticks are resting. Nothing to do for those,
+	// unless a stick filter is still on its way.
+	if (gamepad->usb_in_last_valid && !memcmp(gamepad->usb_in_last, data, REPORT_SIZE) &&
+			!gamepad->stick_filter[GAMEPAD_STICK_LEFT].moving &&
+			!gamepad->stick_filter[GAMEPAD_STICK_RIGHT].moving) {
+		gamepad_stat_inc(gamepad, in_unchanged);
+		gamepad_snapshot_publish(gamepad);
+		return 0;
+	}
+	memcpy(gamepad->usb_in_last, data, REPORT_SIZE);
+	gamepad->usb_in_last_valid = true;
+
+	// Turbo may have hidden a button, the trigger hysteresis needs
+	// the buttons as they are held
+	state->buttons |= gamepad->turbo_held;
+
+	gamepad_report_parse(gamepad->model, gamepad->stick_calibration, gamepad->stick_filter,
+		&gamepad->keymap, data, state);
+
+	// Actions, e.g. the heartbeat to the kernel log
+	gamepad_actions_match(gamepad, state->pressed);
+
+	// Turbo buttons follow their own timer
+	gamepad_turbo_apply(gamepad, gamepad->usb_in_time);
+
+	// The events carry the time of the USB transfer
+	changes = gamepad_input_process(gamepad, ktime_sub(gamepad->usb_in_time, gamepad->usb_in_age));
+	if (changes) {
+		gamepad_latency_sync(gamepad);
+		gamepad_in_changed(gamepad);
+	}
+	gamepad_snapshot_publish(gamepad);
+
+	return changes;
+}
+
+// Callback for incoming data
+static void gamepad_in_cb(struct urb *urb) {
+	struct gamepad_in_slot *slot = urb->context;
+	struct gamepad *gamepad = slot->gamepad;
+
+	uint8_t data[PACKET_SIZE];
+	unsigned int length;
+	uint32_t sequence;
+	unsigned long flags;
+	int status = urb->status;
+	bool starved;
+
+	// When the report arrived, not when it gets processed
+	ktime_t completed = ktime_get();
+
+	// The host controller had nothing left to fill when this was the last
+	// queued URB. Happens when completions are handled too late.
+	starved = atomic_dec_and_test(&gamepad->usb_in_queued);
+
+	trace_gamepad_in_complete(gamepad->usb_device, status, urb->actual_length,
+		status || !urb->actual_length ? -1 : slot->data[0], slot->sequence);
+
+	// Failed transfers carry no report
+	if (status) {
+		switch (status) {
+		// Unlinked or gone, not an error
+		case -ENOENT:
+		case -ECONNRESET:
+		case -ESHUTDOWN:
+			return;
+		// The endpoint stalled, only clearing the halt helps
+		case -EPIPE:
+			set_bit(GAMEPAD_IN_HALTED, &gamepad->usb_in_recover);
+			gamepad_stat_inc(gamepad, in_errors);
+			break;
+		// Transmission errors between the host and the dongle,
+		// e.g. the 2.4G link dropped
+		case -EPROTO:
+		case -EILSEQ:
+		case -ETIME:
+		case -EOVERFLOW:
+			gamepad_stat_inc(gamepad, in_link_errors);
+			fallthrough;
+		default:
+			gamepad_stat_inc(gamepad, in_errors);
+			break;
+		}
+
+		// The recovery submits the URB again later
+		set_bit(slot - gamepad->usb_in_slots, &gamepad->usb_in_recover);
+		gamepad_recover(gamepad, status);
+		return;
+	}
+
+	gamepad_stat_inc(gamepad, in_packets);
+
+	// Working again
+	if (atomic_read(&gamepad->recover_attempts) && atomic_xchg(&gamepad->recover_attempts, 0)) {
+		gamepad_stat_inc(gamepad, in_recoveries);
+		log_info("Input recovered\n");
+	}
+	if (starved && gamepad->active && !READ_ONCE(gamepad->usb_in_slow))
+		gamepad_stat_inc(gamepad, in_starved);
+
+	// Take the report out of the URB and put the URB back at the end of
+	// the ring right away, the host controller can fill it meanwhile
+	sequence = slot->sequence;
+	length = min_t(unsigned int, urb->actual_length, PACKET_SIZE);
+	memset(data, 0, sizeof(data));
+	memcpy(data, slot->data, length);
+
+	// Only send packets to active gamepads
+	if (gamepad->active && !gamepad->suspended && !gamepad_in_park(gamepad, slot, completed))
+		gamepad_in_submit(gamepad, slot);
+
+	spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+
+	// The raw device gets every report, in completion order
+	if (gamepad->raw)
+		gamepad_raw_push(gamepad, data, length, sequence, ktime_to_ns(completed));
+
+	// Too short for a report. Zeros would decode as everything released,
+	// so there is nothing to decode at all.
+	if (length < REPORT_SIZE)
+		gamepad_stat_inc(gamepad, in_short);
+
+	// Reports are processed in the order the URBs were submitted.
+	// Anything older than the last processed report is outdated.
+	else if ((int32_t)(sequence - gamepad->usb_in_delivered) > 0) {
+		gamepad->usb_in_delivered = sequence;
+		gamepad->usb_in_time = completed;
+		gamepad_latency_completion(gamepad);
+		gamepad_in_report(gamepad, data);
+	}
+	else
+		gamepad_stat_inc(gamepad, in_stale);
+
+	spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+}
+
+// Give up the output URB. Anyone who saw it busy left us their request in
+// the mailbox, so the caller has to look there afterwards.
+static void gamepad_out_release(struct gamepad *gamepad) {
+	clear_bit(GAMEPAD_OUT_BUSY, &gamepad->usb_out_flags);
+	smp_mb__after_atomic();
+}
+
+// Callback for outgoing data
+static void gamepad_out_cb(struct urb *urb) {
+	struct gamepad *gamepad = urb->context;
+
+	trace_gamepad_out_complete(gamepad->usb_device, urb->status);
+
+	if (!urb->status)
+		gamepad_stat_inc(gamepad, out_packets);
+	else if (urb->status != -ENOENT && urb->status != -ECONNRESET && urb->status != -ESHUTDOWN)
+		gamepad_stat_inc(gamepad, out_errors);
+
+	// Whatever we sent may not have arrived
+	if (urb->status)
+		gamepad->rumble_sent = RUMBLE_UNKNOWN;
+
+	// The recovery clears the halt and releases the URB afterwards
+	if (urb->status == -EPIPE) {
+		set_bit(GAMEPAD_OUT_HALTED, &gamepad->usb_out_flags);
+		gamepad_recover(gamepad, urb->status);
+	}
+	else {
+		gamepad_out_release(gamepad);
+
+		// Rumble requests that arrived in the meantime are waiting
+		gamepad_rumble_flush(gamepad);
+	}
+
+	// Taken by gamepad_out_submit, may be the last one after disconnect
+	kref_put(&gamepad->kref, gamepad_release);
+}
+
+// Send one of the prepared packets, the caller owns the output URB
+// through GAMEPAD_OUT_BUSY
+static int gamepad_out_submit(struct gamepad *gamepad, enum gamepad_out_packet packet) {
+	struct gamepad_out_buffer *buffer = &gamepad->usb_out[packet];
+	int error;
+
+	// Disconnect is stopping the output
+	if (!gamepad->active)
+		return -ENODEV;
+
+	// Wake the gamepad up first, resuming sends the mailbox content
+	if (gamepad->suspended) {
+		schedule_work(&gamepad->pm_work);
+		return -EAGAIN;
+	}
+
+	// The self test has no USB, the packet counts as sent.
+	// Its benchmark completes the transfer, see gamepad_test_out_complete.
+	if (!gamepad->usb_device)
+		return 0;
+
+	gamepad->usb_out_urb->transfer_buffer = buffer->data;
+	gamepad->usb_out_urb->transfer_dma = buffer->dma;
+	gamepad->usb_out_urb->transfer_buffer_length = buffer->size;
+
+	// Send and look for errors
+	// The transfer keeps the gamepad alive until gamepad_out_cb is done
+	kref_get(&gamepad->kref);
+	usb_anchor_urb(gamepad->usb_out_urb, &gamepad->usb_out_anchor);
+	error = usb_submit_urb(gamepad->usb_out_urb, GFP_ATOMIC);
+	if (error) {
+		usb_unanchor_urb(gamepad->usb_out_urb);
+		gamepad_stat_inc(gamepad, out_submit_errors);
+		kref_put(&gamepad->kref, gamepad_release);
+	}
+
+	return error;
+}
+
+// Send rumble message
+// The request is left in the mailbox and replaces anything not sent yet.
+// The gamepad motors can only handle one value at a time anyway, so a burst
+// of requests ends up as one transfer with the newest value.
+static void gamepad_rumble_message(struct gamepad *gamepad, uint16_t weak, uint16_t strong) {
+
+	// Only send packets to active gamepads
+	if (!gamepad->active) {
+		gamepad_stat_inc(gamepad, rumble_dropped);
+		trace_gamepad_rumble_skip(gamepad->usb_device, GAMEPAD_RUMBLE_DROPPED);
+		return;
+	}
+
+	gamepad_stat_inc(gamepad, rumble_requests);
+	trace_gamepad_rumble_request(gamepad->usb_device, strong / 256, weak / 256);
+	if (gamepad->usb_device)
+		usb_mark_last_busy(gamepad->usb_device);
+	if (atomic_xchg(&gamepad->rumble_mailbox, RUMBLE_PENDING | (weak / 256) << 8 | (strong / 256)) & RUMBLE_PENDING) {
+		gamepad_stat_inc(gamepad, rumble_coalesced);
+		trace_gamepad_rumble_skip(gamepad->usb_device, GAMEPAD_RUMBLE_COALESCED);
+	}
+	gamepad_rumble_flush(gamepad);
+}
+
+// Send the mailbox content, unless a transfer is running right now.
+// In that case gamepad_out_cb picks it up as soon as the transfer is done.
+// Values already on the motors are dropped. Values that come too soon after
+// the last message wait for rumble_timer, so the last one always gets sent.
+static void gamepad_rumble_flush(struct gamepad *gamepad) {
+
+	const struct gamepad_model *model = gamepad->model;
+	uint8_t *data = gamepad->usb_out[GAMEPAD_OUT_RUMBLE].data;
+	unsigned int interval;
+	ktime_t allowed;
+	int value;
+	int error;
+
+	// Disconnect is stopping the output, the last output callback
+	// must not leave rumble_timer running
+	if (!gamepad->active)
+		return;
+
+	while (!test_and_set_bit(GAMEPAD_OUT_BUSY, &gamepad->usb_out_flags)) {
+
+		value = atomic_xchg(&gamepad->rumble_mailbox, 0);
+
+		// The motors run like this already
+		if ((value & RUMBLE_PENDING) && RUMBLE_MOTORS(value) == gamepad->rumble_sent) {
+			gamepad_stat_inc(gamepad, rumble_unchanged);
+			trace_gamepad_rumble_skip(gamepad->usb_device, GAMEPAD_RUMBLE_UNCHANGED);
+			value = 0;
+		}
+
+		// Nothing to send, release the output again. A request may have
+		// arrived after our look into the mailbox, so check once more.
+		if (!(value & RUMBLE_PENDING)) {
+			gamepad_out_release(gamepad);
+			if (!(atomic_read(&gamepad->rumble_mailbox) & RUMBLE_PENDING))
+				return;
+			continue;
+		}
+
+		// Too soon, put the value back, unless there is a newer one,
+		// and wait. A request arriving meanwhile sees the timer running
+		// when it gets here.
+		interval = READ_ONCE(gamepad->rumble_interval);
+		allowed = ktime_add_ms(gamepad->rumble_sent_at, interval);
+		if (interval && ktime_before(ktime_get(), allowed)) {
+			atomic_cmpxchg(&gamepad->rumble_mailbox, 0, value);
+			gamepad_out_release(gamepad);
+			if (atomic_read(&gamepad->rumble_mailbox) & RUMBLE_PENDING) {
+				gamepad_stat_inc(gamepad, rumble_delayed);
+				trace_gamepad_rumble_skip(gamepad->usb_device, GAMEPAD_RUMBLE_DELAYED);
+				hrtimer_start(&gamepad->rumble_timer, allowed, HRTIMER_MODE_ABS);
+			}
+			return;
+		}
+
+		// Only the motor values change, the rest of the rumble sequence
+		// is in the buffer since probe
+		data[model->rumble_strong] = RUMBLE_STRONG(value);
+		data[model->rumble_weak] = RUMBLE_WEAK(value);
+
+		error = gamepad_out_submit(gamepad, GAMEPAD_OUT_RUMBLE);
+		trace_gamepad_rumble_submit(gamepad->usb_device, RUMBLE_STRONG(value), RUMBLE_WEAK(value), error);
+		if (!error) {
+			gamepad->rumble_sent = RUMBLE_MOTORS(value);
+			gamepad->rumble_sent_at = ktime_get();
+			return;
+		}
+
+		// Sending failed. Put the value back, unless there is a newer one,
+		// so the motors get it when the output works again.
+		atomic_cmpxchg(&gamepad->rumble_mailbox, 0, value);
+		gamepad_out_release(gamepad);
+		return;
+	}
+}
+
+// The minimum interval is over, send what waited
+static enum hrtimer_restart gamepad_rumble_timer(struct hrtimer *timer) {
+	struct gamepad *gamepad = container_of(timer, struct gamepad, rumble_timer);
+
+	gamepad_rumble_flush(gamepad);
+
+	return HRTIMER_NORESTART;
+}
+
+// Send initialisation message
+static int gamepad_welcome_message(struct gamepad *gamepad) {
+
+	int error;
+
+	// Only send packets to active gamepads
+	if (!gamepad->active)
+		return -ENODEV;
+
+	// Skip if already sending
+	if (test_and_set_bit(GAMEPAD_OUT_BUSY, &gamepad->usb_out_flags))
+		return -EBUSY;
+
+	// The gamepad needs a message from the host to start working.
+	// So let's be nice and say hello:
+	error = gamepad_out_submit(gamepad, GAMEPAD_OUT_WELCOME);
+	if (error) {
+		gamepad_out_release(gamepad);
+		gamepad_rumble_flush(gamepad);
+	}
+
+	return error;
+}
+
+// Prepare the output URB, an interval of 0 uses the endpoint descriptor
+static void gamepad_out_fill(struct gamepad *gamepad, unsigned int interval) {
+
+	if (!interval)
+		interval = gamepad->usb_endpoint_out->bInterval;
+
+	// Poisoning keeps rumble messages away while the URB is refilled
+	usb_poison_urb(gamepad->usb_out_urb);
+	usb_fill_int_urb(gamepad->usb_out_urb, gamepad->usb_device,
+		usb_sndintpipe(gamepad->usb_device, gamepad->usb_endpoint_out->bEndpointAddress),
+		gamepad->usb_out[GAMEPAD_OUT_RUMBLE].data, PACKET_SIZE,
+		gamepad_out_cb, gamepad,
+		interval);
+	gamepad->usb_out_urb->transfer_dma = gamepad->usb_out[GAMEPAD_OUT_RUMBLE].dma;
+	gamepad->usb_out_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	usb_unpoison_urb(gamepad->usb_out_urb);
+}
+
+// Start the output and say hello
+static int gamepad_out_start(struct gamepad *gamepad) {
+	int error;
+
+	gamepad_out_fill(gamepad, gamepad->out_interval);
+	error = gamepad_welcome_message(gamepad);
+
+	// The host controller does not like our interval, use the descriptor
+	if (error == -EINVAL && gamepad->out_interval) {
+		log_err("Output interval %u rejected, falling back to %u\n",
+			gamepad->out_interval, gamepad->usb_endpoint_out->bInterval);
+		gamepad->out_interval = 0;
+		gamepad_out_fill(gamepad, 0);
+		error = gamepad_welcome_message(gamepad);
+	}
+
+	return error;
+}
+
+/******************************************************************************
+ * Turbo
+ ******************************************************************************/
+
+// Hide turbo buttons during the released half of their period and set the
+// timer to the next edge
+// Called with usb_in_lock held and all held buttons in the state. A turbo
+// button starts pressed, so the first press goes out without delay.
+static void gamepad_turbo_apply(struct gamepad *gamepad, ktime_t now) {
+	struct gamepad_state *state = &gamepad->state;
+	unsigned long held = state->buttons & (gamepad->turbo_enabled ? gamepad->turbo_buttons : 0);
+	unsigned long pressed = held & ~gamepad->turbo_held;
+	uint32_t hidden = 0;
+	ktime_t next = KTIME_MAX;
+	ktime_t edge;
+	u64 elapsed;
+	u32 half;
+	u32 rest;
+	unsigned int bit;
+
+	gamepad->turbo_held = held;
+	if (!held)
+		return;
+
+	for_each_set_bit(bit, &pressed, GAMEPAD_CHORD_FIRST)
+		gamepad->turbo_start[bit] = now;
+
+	for_each_set_bit(bit, &held, GAMEPAD_CHORD_FIRST) {
+		half = NSEC_PER_SEC / 2 / gamepad->turbo_rate[bit];
+		elapsed = ktime_to_ns(ktime_sub(now, gamepad->turbo_start[bit]));
+		if (div_u64_rem(elapsed, half, &rest) & 1)
+			hidden |= BIT(bit);
+
+		edge = ktime_add_ns(now, half - rest);
+		if (ktime_before(edge, next))
+			next = edge;
+	}
+
+	state->buttons &= ~hidden;
+	hrtimer_start(&gamepad->turbo_timer, next, HRTIMER_MODE_ABS);
+}
+
+// Use changed turbo settings right away, buttons held already start over
+// Called with config_lock held
+static void gamepad_turbo_update(struct gamepad *gamepad) {
+
+	spin_lock_irq(&gamepad->usb_in_lock);
+	gamepad->state.buttons |= gamepad->turbo_held;
+	gamepad->turbo_held = 0;
+	if (gamepad->active) {
+		gamepad_turbo_apply(gamepad, ktime_get());
+		gamepad_input_process(gamepad, ktime_get());
+	}
+	spin_unlock_irq(&gamepad->usb_in_lock);
+}
+
+// Next edge of a turbo button, reported like any other change
+// Reports that don't change anything are dropped before they get this far,
+// so a held button keeps going even while the reports stay the same.
+static enum hrtimer_restart gamepad_turbo_timer(struct hrtimer *timer) {
+	struct gamepad *gamepad = container_of(timer, struct gamepad, turbo_timer);
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+	if (gamepad->active && gamepad->turbo_held) {
+		gamepad->state.buttons |= gamepad->turbo_held;
+		gamepad_turbo_apply(gamepad, now);
+		gamepad_input_process(gamepad, now);
+
+		// Someone holds a button, keep polling at full speed
+		gamepad->usb_in_changed = now;
+		gamepad_snapshot_publish(gamepad);
+	}
+	spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/******************************************************************************
+ * Recovery after transfer errors
+ ******************************************************************************/
+
+// Start the recovery, called from the URB callbacks
+// The first attempt runs right away, every further one waits twice as long
+// as the one before.
+static void gamepad_recover(struct gamepad *gamepad, int status) {
+	unsigned int attempts = atomic_read(&gamepad->recover_attempts);
+	unsigned long delay = 0;
+
+	if (!gamepad->active)
+		return;
+
+	if (attempts)
+		delay = msecs_to_jiffies(min(RECOVER_DELAY_MIN_MS << min(attempts - 1, 8U), RECOVER_DELAY_MAX_MS));
+	else
+		WRITE_ONCE(gamepad->recover_status, status);
+
+	schedule_delayed_work(&gamepad->recover_work, delay);
+}
+
+static void gamepad_recover_work(struct work_struct *work) {
+	struct gamepad *gamepad = container_of(to_delayed_work(work), struct gamepad, recover_work);
+	unsigned long failed;
+	unsigned int i;
+	int error = 0;
+
+	// Keeps sysfs from restarting the input meanwhile
+	mutex_lock(&gamepad->config_lock);
+
+	// Resume starts the input again anyway
+	if (!gamepad->active || gamepad->suspended)
+		goto unlock;
+
+	if (atomic_inc_return(&gamepad->recover_attempts) == 1)
+		log_err("Transfer failed (%d), recovering\n", READ_ONCE(gamepad->recover_status));
+
+	// A stalled output endpoint, the output URB is still ours
+	if (test_bit(GAMEPAD_OUT_HALTED, &gamepad->usb_out_flags)) {
+		usb_clear_halt(gamepad->usb_device,
+			usb_sndintpipe(gamepad->usb_device, gamepad->usb_endpoint_out->bEndpointAddress));
+		gamepad_stat_inc(gamepad, halts);
+		clear_bit(GAMEPAD_OUT_HALTED, &gamepad->usb_out_flags);
+		gamepad_out_release(gamepad);
+		gamepad_rumble_flush(gamepad);
+	}
+
+	failed = xchg(&gamepad->usb_in_recover, 0);
+	if (!failed)
+		goto unlock;
+
+	// A stalled input endpoint, no URB may be queued while clearing the halt
+	if (failed & BIT(GAMEPAD_IN_HALTED)) {
+		gamepad_in_stop(gamepad);
+		usb_clear_halt(gamepad->usb_device,
+			usb_rcvintpipe(gamepad->usb_device, gamepad->usb_endpoint_in->bEndpointAddress));
+		gamepad_stat_inc(gamepad, halts);
+
+		// Stops the whole ring again when it fails
+		error = gamepad_in_submit_all(gamepad);
+		if (error) {
+			for (i=0; i<gamepad->usb_in_count; i++)
+				set_bit(i, &gamepad->usb_in_recover);
+		}
+	}
+	else {
+		for_each_set_bit(i, &failed, gamepad->usb_in_count) {
+			error = gamepad_in_submit(gamepad, &gamepad->usb_in_slots[i]);
+			if (error)
+				set_bit(i, &gamepad->usb_in_recover);
+			else
+				gamepad_stat_inc(gamepad, in_retries);
+		}
+	}
+
+	// Gone for good, disconnect follows
+	if (error == -ENODEV || error == -ESHUTDOWN)
+		goto unlock;
+
+	// Try again a bit later
+	if (error) {
+		gamepad_recover(gamepad, error);
+		goto unlock;
+	}
+
+	// The gamepad may have lost the dongle, say hello again
+	gamepad_welcome_message(gamepad);
+
+unlock:
+	mutex_unlock(&gamepad->config_lock);
+}
+
+
+/******************************************************************************
+ * Power management
+ ******************************************************************************/
+
+// Stop all transfers, the gamepad wakes us up again when something happens
+static int gamepad_suspend(struct usb_interface *interface, pm_message_t message) {
+	struct gamepad *gamepad = usb_get_intfdata(interface);
+
+	// Don't cut off a rumble message for an autosuspend
+	if (PMSG_IS_AUTO(message) &&
+			(test_bit(GAMEPAD_OUT_BUSY, &gamepad->usb_out_flags) ||
+			(atomic_read(&gamepad->rumble_mailbox) & RUMBLE_PENDING)))
+		return -EBUSY;
+
+	// Nothing gets submitted from here on
+	gamepad->suspended = true;
+	smp_mb();
+
+	// Whatever the recovery submitted gets stopped right after
+	cancel_delayed_work_sync(&gamepad->recover_work);
+
+	gamepad_in_stop(gamepad);
+	usb_kill_anchored_urbs(&gamepad->usb_out_anchor);
+
+	return 0;
+}
+
+// Start polling again and say hello, the gamepad may have forgotten us
+static int gamepad_resume(struct usb_interface *interface) {
+	struct gamepad *gamepad = usb_get_intfdata(interface);
+	int error;
+
+	// A reset may have stopped the motors. Nothing is sent while
+	// suspended, so nobody else uses this right now.
+	gamepad->rumble_sent = RUMBLE_UNKNOWN;
+
+	gamepad->suspended = false;
+	smp_mb();
+
+	// The URBs still have their interval from before
+	error = gamepad_in_submit_all(gamepad);
+	if (error)
+		log_err("Restarting input failed (%d)\n", error);
+
+	// An output halt waited for us
+	if (test_bit(GAMEPAD_OUT_HALTED, &gamepad->usb_out_flags))
+		schedule_delayed_work(&gamepad->recover_work, 0);
+
+	// Sends the waiting rumble request as well, when the welcome
+	// message is done. Busy means a rumble message is already out.
+	gamepad_welcome_message(gamepad);
+
+	return error;
+}
+
+// Rumble while suspended, resume so the output works again
+static void gamepad_pm_work(struct work_struct *work) {
+	struct gamepad *gamepad = container_of(work, struct gamepad, pm_work);
+
+	if (!usb_autopm_get_interface(gamepad->usb_interface))
+		usb_autopm_put_interface(gamepad->usb_interface);
+}
+
+
+/******************************************************************************
+ * Settings in sysfs
+ ******************************************************************************/
+
+// Configured input interval, 0 = endpoint descriptor
+static ssize_t in_interval_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%u\n", gamepad->in_interval);
+}
+
+static ssize_t in_interval_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int value;
+	int error;
+
+	error = kstrtouint(buf, 0, &value);
+	if (error)
+		return error;
+	if (value > 255)
+		return -EINVAL;
+
+	// Restart the input ring with the new interval, the gamepad has to be
+	// awake for that
+	error = usb_autopm_get_interface(gamepad->usb_interface);
+	if (error)
+		return error;
+	mutex_lock(&gamepad->config_lock);
+	gamepad->in_interval = value;
+	gamepad_in_stop(gamepad);
+	error = gamepad_in_start(gamepad);
+	mutex_unlock(&gamepad->config_lock);
+	usb_autopm_put_interface(gamepad->usb_interface);
+
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(in_interval);
+
+// Configured output interval, 0 = endpoint descriptor
+static ssize_t out_interval_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%u\n", gamepad->out_interval);
+}
+
+static ssize_t out_interval_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int value;
+	int error;
+
+	error = kstrtouint(buf, 0, &value);
+	if (error)
+		return error;
+	if (value > 255)
+		return -EINVAL;
+
+	// Restart the output with the new interval
+	error = usb_autopm_get_interface(gamepad->usb_interface);
+	if (error)
+		return error;
+	mutex_lock(&gamepad->config_lock);
+	gamepad->out_interval = value;
+	error = gamepad_out_start(gamepad);
+	mutex_unlock(&gamepad->config_lock);
+	usb_autopm_put_interface(gamepad->usb_interface);
+
+	// A rumble message got there first, the new interval is in use anyway
+	if (error == -EBUSY)
+		error = 0;
+
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(out_interval);
+
+// Effective polling periods, as negotiated with the host controller
+static ssize_t in_period_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%u\n", gamepad_urb_period_us(gamepad, gamepad->usb_in_slots[0].urb));
+}
+static DEVICE_ATTR_RO(in_period_us);
+
+static ssize_t out_period_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%u\n", gamepad_urb_period_us(gamepad, gamepad->usb_out_urb));
+}
+static DEVICE_ATTR_RO(out_period_us);
+
+// LT and RT as buttons, axes or both
+static ssize_t trigger_mode_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%s\n", gamepad_trigger_mode_names[gamepad->trigger_mode]);
+}
+
+static ssize_t trigger_mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	int mode;
+	int error = 0;
+
+	mode = sysfs_match_string(gamepad_trigger_mode_names, buf);
+	if (mode < 0)
+		return mode;
+
+	// The input device needs to be created again with new capabilities
+	error = usb_autopm_get_interface(gamepad->usb_interface);
+	if (error)
+		return error;
+	mutex_lock(&gamepad->config_lock);
+	if (gamepad->trigger_mode != mode) {
+		gamepad->trigger_mode = mode;
+		error = gamepad_input_reconnect(gamepad);
+	}
+	mutex_unlock(&gamepad->config_lock);
+	usb_autopm_put_interface(gamepad->usb_interface);
+
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(trigger_mode);
+
+// Set fuzz or flat of both trigger axes
+static ssize_t gamepad_trigger_abs_store(struct gamepad *gamepad, int *setting, bool fuzz, const char *buf, size_t count) {
+	unsigned int value;
+	int error;
+
+	error = kstrtouint(buf, 0, &value);
+	if (error)
+		return error;
+	if (value > 255)
+		return -EINVAL;
+
+	mutex_lock(&gamepad->config_lock);
+	*setting = value;
+	if (gamepad->input_device_active && gamepad->trigger_mode != GAMEPAD_TRIGGER_DIGITAL) {
+		if (fuzz) {
+			input_abs_set_fuzz(gamepad->input_device, ABS_Z, value);
+			input_abs_set_fuzz(gamepad->input_device, ABS_RZ, value);
+		}
+		else {
+			input_abs_set_flat(gamepad->input_device, ABS_Z, value);
+			input_abs_set_flat(gamepad->input_device, ABS_RZ, value);
+		}
+	}
+	mutex_unlock(&gamepad->config_lock);
+
+	return count;
+}
+
+static ssize_t trigger_fuzz_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%d\n", gamepad->trigger_fuzz);
+}
+
+static ssize_t trigger_fuzz_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return gamepad_trigger_abs_store(gamepad, &gamepad->trigger_fuzz, true, buf, count);
+}
+static DEVICE_ATTR_RW(trigger_fuzz);
+
+static ssize_t trigger_flat_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%d\n", gamepad->trigger_flat);
+}
+
+static ssize_t trigger_flat_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return gamepad_trigger_abs_store(gamepad, &gamepad->trigger_flat, false, buf, count);
+}
+static DEVICE_ATTR_RW(trigger_flat);
+
+// Minimum time between two rumble messages
+static ssize_t rumble_interval_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(gamepad->rumble_interval));
+}
+
+static ssize_t rumble_interval_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int value;
+	int error;
+
+	error = kstrtouint(buf, 0, &value);
+	if (error)
+		return error;
+	if (value > RUMBLE_INTERVAL_MAX)
+		return -EINVAL;
+
+	// Used by the next rumble message
+	WRITE_ONCE(gamepad->rumble_interval, value);
+
+	return count;
+}
+static DEVICE_ATTR_RW(rumble_interval);
+
+// Slow polling while idle
+static ssize_t slow_after_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%u\n", gamepad->slow_after);
+}
+
+static ssize_t slow_after_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int value;
+	int error;
+
+	error = kstrtouint(buf, 0, &value);
+	if (error)
+		return error;
+	if (value > SLOW_AFTER_MAX)
+		return -EINVAL;
+
+	// Used by the next report. Turned off, the next change brings the
+	// kept back URBs back.
+	WRITE_ONCE(gamepad->slow_after, value);
+
+	return count;
+}
+static DEVICE_ATTR_RW(slow_after);
+
+static ssize_t slow_interval_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+
+	return sysfs_emit(buf, "%u\n", gamepad->slow_interval);
+}
+
+static ssize_t slow_interval_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int value;
+	int error;
+
+	error = kstrtouint(buf, 0, &value);
+	if (error)
+		return error;
+	if (value < SLOW_INTERVAL_MIN || value > SLOW_INTERVAL_MAX)
+		return -EINVAL;
+
+	// Used from the next slow_timer period
+	WRITE_ONCE(gamepad->slow_interval, value);
+
+	return count;
+}
+static DEVICE_ATTR_RW(slow_interval);
+
+// Button mapping
+// Find a button by its name, only the first count buttons
+static int gamepad_button_lookup(const char *name, unsigned int count) {
+	unsigned int i;
+
+	for (i=0; i<count; i++) {
+		if (gamepad_button_names[i] && !strcmp(gamepad_button_names[i], name))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+// Evdev code, 0 = not reported
+static int gamepad_code_parse(const char *buf, unsigned int *code) {
+	int error;
+
+	error = kstrtouint(buf, 0, code);
+	if (error)
+		return error;
+	if (*code > KEY_MAX)
+		return -EINVAL;
+
+	return 0;
+}
+
+// Use a new button mapping, the input device is created again with it.
+// Called with config_lock held and the gamepad awake.
+static int gamepad_keymap_apply(struct gamepad *gamepad, struct gamepad_keymap *keymap) {
+	int error;
+
+	error = gamepad_keymap_compile(keymap);
+	if (error)
+		return error;
+
+	gamepad_in_stop(gamepad);
+	gamepad->keymap = *keymap;
+
+	return gamepad_input_reconnect(gamepad);
+}
+
+// Parse "name=code" pairs
+static int gamepad_button_map_parse(struct gamepad_keymap *keymap, const char *buf) {
+	char *copy;
+	char *cursor;
+	char *token;
+	char *name;
+	unsigned int code;
+	int button;
+	int error = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cursor = strim(copy);
+	while ((token = strsep(&cursor, " \t\n")) != NULL) {
+		if (!*token)
+			continue;
+		name = strsep(&token, "=");
+		if (!token) {
+			error = -EINVAL;
+			break;
+		}
+		button = gamepad_button_lookup(name, GAMEPAD_CHORD_FIRST);
+		if (button < 0) {
+			error = button;
+			break;
+		}
+		error = gamepad_code_parse(token, &code);
+		if (error)
+			break;
+		keymap->codes[button] = code;
+	}
+
+	kfree(copy);
+	return error;
+}
+
+// Parse "name+name+...=code" chords, replacing all chords
+static int gamepad_chords_parse(struct gamepad_keymap *keymap, const char *buf) {
+	struct gamepad_chord chord;
+	char *copy;
+	char *cursor;
+	char *token;
+	char *names;
+	char *name;
+	unsigned int count = 0;
+	int button;
+	int error = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cursor = strim(copy);
+	while (!error && (token = strsep(&cursor, " \t\n")) != NULL) {
+		if (!*token)
+			continue;
+		if (count == CHORDS_MAX) {
+			error = -EINVAL;
+			break;
+		}
+		names = strsep(&token, "=");
+		if (!token) {
+			error = -EINVAL;
+			break;
+		}
+
+		// Chords are made of real buttons only
+		chord.buttons = 0;
+		while ((name = strsep(&names, "+")) != NULL) {
+			button = gamepad_button_lookup(name, 16);
+			if (button < 0) {
+				error = button;
+				break;
+			}
+			chord.buttons |= BIT(button);
+		}
+		if (!error)
+			error = gamepad_code_parse(token, &chord.code);
+		if (!error)
+			keymap->chords[count++] = chord;
+	}
+
+	if (!error)
+		keymap->chord_count = count;
+
+	kfree(copy);
+	return error;
+}
+
+// Evdev code of every button, "name=code" per line
+static ssize_t button_map_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	ssize_t len = 0;
+	unsigned int i;
+
+	mutex_lock(&gamepad->config_lock);
+	for (i=0; i<GAMEPAD_CHORD_FIRST; i++) {
+		if (gamepad_button_names[i])
+			len += sysfs_emit_at(buf, len, "%s=%u\n", gamepad_button_names[i], gamepad->keymap.codes[i]);
+	}
+	mutex_unlock(&gamepad->config_lock);
+
+	return len;
+}
+
+static ssize_t button_map_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_keymap *keymap;
+	int error;
+
+	// Work on a copy, the input keeps using the old mapping
+	keymap = kmalloc(sizeof(*keymap), GFP_KERNEL);
+	if (!keymap)
+		return -ENOMEM;
+
+	error = usb_autopm_get_interface(gamepad->usb_interface);
+	if (error) {
+		kfree(keymap);
+		return error;
+	}
+
+	mutex_lock(&gamepad->config_lock);
+	*keymap = gamepad->keymap;
+	if (sysfs_streq(buf, "default"))
+		gamepad_keymap_default_buttons(keymap, gamepad->model);
+	else
+		error = gamepad_button_map_parse(keymap, buf);
+	if (!error)
+		error = gamepad_keymap_apply(gamepad, keymap);
+	mutex_unlock(&gamepad->config_lock);
+
+	usb_autopm_put_interface(gamepad->usb_interface);
+	kfree(keymap);
+
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(button_map);
+
+// Chords, "name+name+...=code" per line
+static ssize_t chords_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_chord *chord;
+	ssize_t len = 0;
+	unsigned int i;
+	unsigned int bit;
+	bool first;
+
+	mutex_lock(&gamepad->config_lock);
+	for (i=0; i<gamepad->keymap.chord_count; i++) {
+		chord = &gamepad->keymap.chords[i];
+		first = true;
+		for (bit=0; bit<16; bit++) {
+			if (chord->buttons & BIT(bit)) {
+				len += sysfs_emit_at(buf, len, "%s%s", first ? "" : "+", gamepad_button_names[bit]);
+				first = false;
+			}
+		}
+		len += sysfs_emit_at(buf, len, "=%u\n", chord->code);
+	}
+	if (!gamepad->keymap.chord_count)
+		len = sysfs_emit(buf, "none\n");
+	mutex_unlock(&gamepad->config_lock);
+
+	return len;
+}
+
+static ssize_t chords_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_keymap *keymap;
+	int error;
+
+	keymap = kmalloc(sizeof(*keymap), GFP_KERNEL);
+	if (!keymap)
+		return -ENOMEM;
+
+	error = usb_autopm_get_interface(gamepad->usb_interface);
+	if (error) {
+		kfree(keymap);
+		return error;
+	}
+
+	mutex_lock(&gamepad->config_lock);
+	*keymap = gamepad->keymap;
+	if (sysfs_streq(buf, "default"))
+		gamepad_keymap_default_chords(keymap, gamepad->model);
+	else if (sysfs_streq(buf, "none"))
+		keymap->chord_count = 0;
+	else
+		error = gamepad_chords_parse(keymap, buf);
+	if (!error)
+		error = gamepad_keymap_apply(gamepad, keymap);
+	mutex_unlock(&gamepad->config_lock);
+
+	usb_autopm_put_interface(gamepad->usb_interface);
+	kfree(keymap);
+
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(chords);
+
+// Parse "name+name+...=action" actions
+static int gamepad_actions_parse(struct gamepad_action *actions, unsigned int *action_count, const char *buf) {
+	struct gamepad_action action;
+	char *copy;
+	char *cursor;
+	char *token;
+	char *names;
+	char *name;
+	unsigned int count = 0;
+	int button;
+	int type;
+	int error = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cursor = strim(copy);
+	while (!error && (token = strsep(&cursor, " \t\n")) != NULL) {
+		if (!*token)
+			continue;
+		if (count == ACTIONS_MAX) {
+			error = -EINVAL;
+			break;
+		}
+		names = strsep(&token, "=");
+		if (!token) {
+			error = -EINVAL;
+			break;
+		}
+
+		// The triggers count as buttons here
+		action.buttons = 0;
+		while ((name = strsep(&names, "+")) != NULL) {
+			button = gamepad_button_lookup(name, GAMEPAD_CHORD_FIRST);
+			if (button < 0) {
+				error = button;
+				break;
+			}
+			action.buttons |= BIT(button);
+		}
+		if (error)
+			break;
+
+		type = match_string(gamepad_action_names, GAMEPAD_ACTION_COUNT, token);
+		if (type < 0) {
+			error = type;
+			break;
+		}
+		action.type = type;
+		actions[count++] = action;
+	}
+
+	if (!error)
+		*action_count = count;
+
+	kfree(copy);
+	return error;
+}
+
+// Actions, "name+name+...=action" per line
+static ssize_t actions_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_action *action;
+	ssize_t len = 0;
+	unsigned int i;
+	unsigned int bit;
+	bool first;
+
+	mutex_lock(&gamepad->config_lock);
+	for (i=0; i<gamepad->action_count; i++) {
+		action = &gamepad->actions[i];
+		first = true;
+		for (bit=0; bit<GAMEPAD_CHORD_FIRST; bit++) {
+			if (action->buttons & BIT(bit)) {
+				len += sysfs_emit_at(buf, len, "%s%s", first ? "" : "+", gamepad_button_names[bit]);
+				first = false;
+			}
+		}
+		len += sysfs_emit_at(buf, len, "=%s\n", gamepad_action_names[action->type]);
+	}
+	if (!gamepad->action_count)
+		len = sysfs_emit(buf, "none\n");
+	mutex_unlock(&gamepad->config_lock);
+
+	return len;
+}
+
+static ssize_t actions_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_action actions[ACTIONS_MAX];
+	unsigned int action_count = 0;
+	int error = 0;
+
+	if (sysfs_streq(buf, "default")) {
+		action_count = ARRAY_SIZE(gamepad_actions_default);
+		memcpy(actions, gamepad_actions_default, sizeof(gamepad_actions_default));
+	}
+	else if (!sysfs_streq(buf, "none"))
+		error = gamepad_actions_parse(actions, &action_count, buf);
+	if (error)
+		return error;
+
+	mutex_lock(&gamepad->config_lock);
+	spin_lock_irq(&gamepad->usb_in_lock);
+	memcpy(gamepad->actions, actions, action_count * sizeof(*actions));
+	gamepad->action_count = action_count;
+
+	// Buttons held right now have to be released first
+	gamepad->actions_held = ~0UL;
+	gamepad->actions_pending = 0;
+	spin_unlock_irq(&gamepad->usb_in_lock);
+	mutex_unlock(&gamepad->config_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(actions);
+
+// Parse "name=rate" pairs, 0 turns turbo off for a button
+static int gamepad_turbo_parse(uint8_t *rates, const char *buf) {
+	char *copy;
+	char *cursor;
+	char *token;
+	char *name;
+	unsigned int rate;
+	int button;
+	int error = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cursor = strim(copy);
+	while ((token = strsep(&cursor, " \t\n")) != NULL) {
+		if (!*token)
+			continue;
+		name = strsep(&token, "=");
+		if (!token) {
+			error = -EINVAL;
+			break;
+		}
+		button = gamepad_button_lookup(name, GAMEPAD_CHORD_FIRST);
+		if (button < 0) {
+			error = button;
+			break;
+		}
+		error = kstrtouint(token, 0, &rate);
+		if (error)
+			break;
+		if (rate && (rate < TURBO_RATE_MIN || rate > TURBO_RATE_MAX)) {
+			error = -EINVAL;
+			break;
+		}
+		rates[button] = rate;
+	}
+
+	kfree(copy);
+	return error;
+}
+
+// Turbo buttons, "name=rate" per line
+static ssize_t turbo_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	ssize_t len = 0;
+	unsigned int i;
+
+	mutex_lock(&gamepad->config_lock);
+	for (i=0; i<GAMEPAD_CHORD_FIRST; i++) {
+		if (gamepad->turbo_rate[i])
+			len += sysfs_emit_at(buf, len, "%s=%u\n", gamepad_button_names[i], gamepad->turbo_rate[i]);
+	}
+	if (!gamepad->turbo_buttons)
+		len = sysfs_emit(buf, "none\n");
+	mutex_unlock(&gamepad->config_lock);
+
+	return len;
+}
+
+static ssize_t turbo_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	uint8_t rates[GAMEPAD_CHORD_FIRST];
+	unsigned int i;
+	int error = 0;
+
+	mutex_lock(&gamepad->config_lock);
+	memcpy(rates, gamepad->turbo_rate, sizeof(rates));
+	if (sysfs_streq(buf, "none"))
+		memset(rates, 0, sizeof(rates));
+	else
+		error = gamepad_turbo_parse(rates, buf);
+
+	if (!error) {
+		spin_lock_irq(&gamepad->usb_in_lock);
+		memcpy(gamepad->turbo_rate, rates, sizeof(rates));
+		gamepad->turbo_buttons = 0;
+		for (i=0; i<GAMEPAD_CHORD_FIRST; i++) {
+			if (rates[i])
+				gamepad->turbo_buttons |= BIT(i);
+		}
+		spin_unlock_irq(&gamepad->usb_in_lock);
+		gamepad_turbo_update(gamepad);
+	}
+	mutex_unlock(&gamepad->config_lock);
+
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(turbo);
+
+// Stick calibration settings
+enum gamepad_stick_setting {
+	GAMEPAD_STICK_DEADZONE,
+	GAMEPAD_STICK_DEADZONE_MODE,
+	GAMEPAD_STICK_ANTI_DEADZONE,
+	GAMEPAD_STICK_OUTER,
+	GAMEPAD_STICK_CURVE,
+	GAMEPAD_STICK_FILTER,
+};
+
+struct gamepad_stick_attribute {
+	struct device_attribute attr;
+	enum gamepad_stick stick;
+	enum gamepad_stick_setting setting;
+};
+
+static ssize_t gamepad_stick_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_stick_attribute *stick_attr = container_of(attr, struct gamepad_stick_attribute, attr);
+	struct gamepad_stick_calibration *calibration = &gamepad->stick_calibration[stick_attr->stick];
+	ssize_t len = 0;
+	unsigned int i;
+
+	mutex_lock(&gamepad->config_lock);
+	switch (stick_attr->setting) {
+	case GAMEPAD_STICK_DEADZONE:
+		len = sysfs_emit(buf, "%u\n", calibration->deadzone);
+		break;
+	case GAMEPAD_STICK_DEADZONE_MODE:
+		len = sysfs_emit(buf, "%s\n", calibration->axial ? "axial" : "radial");
+		break;
+	case GAMEPAD_STICK_ANTI_DEADZONE:
+		len = sysfs_emit(buf, "%u\n", calibration->anti_deadzone);
+		break;
+	case GAMEPAD_STICK_OUTER:
+		len = sysfs_emit(buf, "%u\n", calibration->outer);
+		break;
+	case GAMEPAD_STICK_CURVE:
+		for (i=0; i<calibration->curve_count; i++)
+			len += sysfs_emit_at(buf, len, "%s%u", i ? " " : "", calibration->curve_points[i]);
+		len += sysfs_emit_at(buf, len, "\n");
+		break;
+	case GAMEPAD_STICK_FILTER:
+		len = sysfs_emit(buf, "%u\n", calibration->filter);
+		break;
+	}
+	mutex_unlock(&gamepad->config_lock);
+
+	return len;
+}
+
+// Read the points of a response curve, e.g. "0 8192 32767"
+static int gamepad_stick_parse_curve(struct gamepad_stick_calibration *calibration, const char *buf) {
+	char *copy;
+	char *cursor;
+	char *token;
+	unsigned int value;
+	unsigned int count = 0;
+	int error = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cursor = strim(copy);
+	while ((token = strsep(&cursor, " \t")) != NULL) {
+		if (!*token)
+			continue;
+		if (count == CURVE_POINTS_MAX) {
+			error = -EINVAL;
+			break;
+		}
+		error = kstrtouint(token, 0, &value);
+		if (error)
+			break;
+		if (value > STICK_MAX) {
+			error = -EINVAL;
+			break;
+		}
+		calibration->curve_points[count++] = value;
+	}
+
+	if (!error && count < 2)
+		error = -EINVAL;
+	if (!error)
+		calibration->curve_count = count;
+
+	kfree(copy);
+	return error;
+}
+
+static ssize_t gamepad_stick_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_stick_attribute *stick_attr = container_of(attr, struct gamepad_stick_attribute, attr);
+	struct gamepad_stick_calibration *calibration;
+	unsigned long flags;
+	unsigned int value = 0;
+	int error = 0;
+
+	// Work on a copy, the input callback keeps using the old settings
+	calibration = kmalloc(sizeof(*calibration), GFP_KERNEL);
+	if (!calibration)
+		return -ENOMEM;
+
+	mutex_lock(&gamepad->config_lock);
+	*calibration = gamepad->stick_calibration[stick_attr->stick];
+
+	switch (stick_attr->setting) {
+	case GAMEPAD_STICK_DEADZONE_MODE:
+		if (sysfs_streq(buf, "axial"))
+			calibration->axial = true;
+		else if (sysfs_streq(buf, "radial"))
+			calibration->axial = false;
+		else
+			error = -EINVAL;
+		break;
+	case GAMEPAD_STICK_CURVE:
+		error = gamepad_stick_parse_curve(calibration, buf);
+		break;
+	case GAMEPAD_STICK_FILTER:
+		error = kstrtouint(buf, 0, &value);
+		if (!error && (value == 1 || value > FILTER_REPORTS_MAX))
+			error = -EINVAL;
+		break;
+	default:
+		error = kstrtouint(buf, 0, &value);
+		if (!error && value > STICK_MAX)
+			error = -EINVAL;
+		break;
+	}
+
+	if (!error) {
+		switch (stick_attr->setting) {
+		case GAMEPAD_STICK_DEADZONE:
+			calibration->deadzone = value;
+			break;
+		case GAMEPAD_STICK_ANTI_DEADZONE:
+			calibration->anti_deadzone = value;
+			break;
+		case GAMEPAD_STICK_OUTER:
+			calibration->outer = value;
+			break;
+		case GAMEPAD_STICK_FILTER:
+			calibration->filter = value;
+			break;
+		default:
+			break;
+		}
+
+		// The outer limit has to stay outside of the dead zone
+		if (calibration->outer <= calibration->deadzone)
+			error = -EINVAL;
+	}
+
+	if (!error) {
+		gamepad_calibration_update(calibration);
+
+		// The next report has to go through the new calibration,
+		// even when it is the same as the last one
+		spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+		gamepad->stick_calibration[stick_attr->stick] = *calibration;
+		memset(&gamepad->stick_filter[stick_attr->stick], 0, sizeof(struct gamepad_stick_filter));
+		gamepad->usb_in_last_valid = false;
+		spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+	}
+	mutex_unlock(&gamepad->config_lock);
+
+	kfree(calibration);
+	return error ? error : count;
+}
+
+#define GAMEPAD_STICK_ATTR(_name, _stick, _setting) \
+	static struct gamepad_stick_attribute gamepad_attr_##_name = { \
+		.attr = __ATTR(_name, 0644, gamepad_stick_show, gamepad_stick_store), \
+		.stick = GAMEPAD_STICK_##_stick, \
+		.setting = GAMEPAD_STICK_##_setting, \
+	}
+
+GAMEPAD_STICK_ATTR(left_deadzone, LEFT, DEADZONE);
+GAMEPAD_STICK_ATTR(left_deadzone_mode, LEFT, DEADZONE_MODE);
+GAMEPAD_STICK_ATTR(left_anti_deadzone, LEFT, ANTI_DEADZONE);
+GAMEPAD_STICK_ATTR(left_outer, LEFT, OUTER);
+GAMEPAD_STICK_ATTR(left_curve, LEFT, CURVE);
+GAMEPAD_STICK_ATTR(left_filter, LEFT, FILTER);
+
+GAMEPAD_STICK_ATTR(right_deadzone, RIGHT, DEADZONE);
+GAMEPAD_STICK_ATTR(right_deadzone_mode, RIGHT, DEADZONE_MODE);
+GAMEPAD_STICK_ATTR(right_anti_deadzone, RIGHT, ANTI_DEADZONE);
+GAMEPAD_STICK_ATTR(right_outer, RIGHT, OUTER);
+GAMEPAD_STICK_ATTR(right_curve, RIGHT, CURVE);
+GAMEPAD_STICK_ATTR(right_filter, RIGHT, FILTER);
+
+static struct attribute *gamepad_attrs[] = {
+	&dev_attr_in_interval.attr,
+	&dev_attr_out_interval.attr,
+	&dev_attr_in_period_us.attr,
+	&dev_attr_out_period_us.attr,
+	&dev_attr_trigger_mode.attr,
+	&dev_attr_trigger_fuzz.attr,
+	&dev_attr_trigger_flat.attr,
+	&dev_attr_rumble_interval.attr,
+	&dev_attr_slow_after.attr,
+	&dev_attr_slow_interval.attr,
+	&dev_attr_button_map.attr,
+	&dev_attr_chords.attr,
+	&dev_attr_actions.attr,
+	&dev_attr_turbo.attr,
+	&gamepad_attr_left_deadzone.attr.attr,
+	&gamepad_attr_left_deadzone_mode.attr.attr,
+	&gamepad_attr_left_anti_deadzone.attr.attr,
+	&gamepad_attr_left_outer.attr.attr,
+	&gamepad_attr_left_curve.attr.attr,
+	&gamepad_attr_left_filter.attr.attr,
+	&gamepad_attr_right_deadzone.attr.attr,
+	&gamepad_attr_right_deadzone_mode.attr.attr,
+	&gamepad_attr_right_anti_deadzone.attr.attr,
+	&gamepad_attr_right_outer.attr.attr,
+	&gamepad_attr_right_curve.attr.attr,
+	&gamepad_attr_right_filter.attr.attr,
+	NULL
+};
+
+static const struct attribute_group gamepad_group = {
+	.attrs = gamepad_attrs,
+};
+
+// Statistics counters
+struct gamepad_stat_attribute {
+	struct device_attribute attr;
+	size_t offset;
+};
+
+static unsigned long gamepad_stat_read(struct gamepad *gamepad, struct gamepad_stat_attribute *stat_attr) {
+	return atomic_long_read((atomic_long_t *)((char *)&gamepad->stats + stat_attr->offset));
+}
+
+static ssize_t gamepad_stat_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct gamepad *gamepad = usb_get_intfdata(to_usb_interface(dev));
+	struct gamepad_stat_attribute *stat_attr = container_of(attr, struct gamepad_stat_attribute, attr);
+
+	return sysfs_emit(buf, "%lu\n", gamepad_stat_read(gamepad, stat_attr));
+}
+
+#define GAMEPAD_STAT_ATTR(_name) \
+	static struct gamepad_stat_attribute gamepad_stat_##_name = { \
+		.attr = __ATTR(_name, 0444, gamepad_stat_show, NULL), \
+		.offset = offsetof(struct gamepad_stats, _name), \
+	}
+
+GAMEPAD_STAT_ATTR(in_packets);
+GAMEPAD_STAT_ATTR(in_short);
+GAMEPAD_STAT_ATTR(in_unchanged);
+GAMEPAD_STAT_ATTR(in_unknown);
+GAMEPAD_STAT_ATTR(in_stale);
+GAMEPAD_STAT_ATTR(in_errors);
+GAMEPAD_STAT_ATTR(in_link_errors);
+GAMEPAD_STAT_ATTR(in_submit_errors);
+GAMEPAD_STAT_ATTR(in_starved);
+GAMEPAD_STAT_ATTR(in_slowdowns);
+GAMEPAD_STAT_ATTR(in_retries);
+GAMEPAD_STAT_ATTR(in_recoveries);
+GAMEPAD_STAT_ATTR(halts);
+GAMEPAD_STAT_ATTR(out_packets);
+GAMEPAD_STAT_ATTR(out_errors);
+GAMEPAD_STAT_ATTR(out_submit_errors);
+GAMEPAD_STAT_ATTR(rumble_requests);
+GAMEPAD_STAT_ATTR(rumble_coalesced);
+GAMEPAD_STAT_ATTR(rumble_unchanged);
+GAMEPAD_STAT_ATTR(rumble_delayed);
+GAMEPAD_STAT_ATTR(rumble_dropped);
+GAMEPAD_STAT_ATTR(raw_dropped);
+
+static struct attribute *gamepad_stats_attrs[] = {
+	&gamepad_stat_in_packets.attr.attr,
+	&gamepad_stat_in_short.attr.attr,
+	&gamepad_stat_in_unchanged.attr.attr,
+	&gamepad_stat_in_unknown.attr.attr,
+	&gamepad_stat_in_stale.attr.attr,
+	&gamepad_stat_in_errors.attr.attr,
+	&gamepad_stat_in_link_errors.attr.attr,
+	&gamepad_stat_in_submit_errors.attr.attr,
+	&gamepad_stat_in_starved.attr.attr,
+	&gamepad_stat_in_slowdowns.attr.attr,
+	&gamepad_stat_in_retries.attr.attr,
+	&gamepad_stat_in_recoveries.attr.attr,
+	&gamepad_stat_halts.attr.attr,
+	&gamepad_stat_out_packets.attr.attr,
+	&gamepad_stat_out_errors.attr.attr,
+	&gamepad_stat_out_submit_errors.attr.attr,
+	&gamepad_stat_rumble_requests.attr.attr,
+	&gamepad_stat_rumble_coalesced.attr.attr,
+	&gamepad_stat_rumble_unchanged.attr.attr,
+	&gamepad_stat_rumble_delayed.attr.attr,
+	&gamepad_stat_rumble_dropped.attr.attr,
+	&gamepad_stat_raw_dropped.attr.attr,
+	NULL
+};
+
+static const struct attribute_group gamepad_stats_group = {
+	.name = "statistics",
+	.attrs = gamepad_stats_attrs,
+};
+
+static const struct attribute_group *gamepad_groups[] = {
+	&gamepad_group,
+	&gamepad_stats_group,
+	NULL
+};
+
+/******************************************************************************
+ * Summary of all gamepads in debugfs
+ ******************************************************************************/
+
+static int gamepad_summary_show(struct seq_file *m, void *unused) {
+	struct gamepad *gamepad;
+	unsigned long totals[ARRAY_SIZE(gamepad_stats_attrs) - 1] = { 0 };
+	unsigned int count = 0;
+	unsigned int i;
+
+	mutex_lock(&gamepad_list_lock);
+	list_for_each_entry(gamepad, &gamepad_list, list) {
+		seq_printf(m, "%s: %s\n", dev_name(&gamepad->usb_interface->dev), gamepad->model->name);
+		for (i=0; i<ARRAY_SIZE(totals); i++)
+			totals[i] += gamepad_stat_read(gamepad, container_of(gamepad_stats_attrs[i],
+				struct gamepad_stat_attribute, attr.attr));
+		count++;
+	}
+	mutex_unlock(&gamepad_list_lock);
+
+	// Statistics of all gamepads added up
+	seq_printf(m, "gamepads: %u\n", count);
+	for (i=0; i<ARRAY_SIZE(totals); i++)
+		seq_printf(m, "%s: %lu\n", gamepad_stats_attrs[i]->name, totals[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gamepad_summary);
+
+
+/******************************************************************************
+ * Raw report channel
+ ******************************************************************************/
+
+// Called with usb_in_lock held, so there is only one producer
+static void gamepad_raw_push(struct gamepad *gamepad, const uint8_t *data, unsigned int length, uint32_t sequence, u64 timestamp) {
+	struct gamepad_raw *raw = gamepad->raw;
+	struct gamepad_raw_header *header = raw->header;
+	struct gamepad_raw_entry *entry;
+	uint32_t head = header->head;
+
+	// Pairs with the reader releasing tail after it is done with the entry
+	if (head - smp_load_acquire(&header->tail) >= raw->entries) {
+		WRITE_ONCE(header->dropped, header->dropped + 1);
+		gamepad_stat_inc(gamepad, raw_dropped);
+		return;
+	}
+
+	entry = &raw->ring[head & (raw->entries - 1)];
+	entry->timestamp = timestamp;
+	entry->sequence = sequence;
+	entry->length = length;
+	memcpy(entry->data, data, PACKET_SIZE);
+
+	// The entry is complete before the reader sees the new head
+	smp_store_release(&header->head, head + 1);
+
+	// Readers drain the whole ring before they sleep in poll
+	if (wq_has_sleeper(&raw->wait))
+		wake_up_interruptible_poll(&raw->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static void gamepad_raw_release(struct kref *kref) {
+	struct gamepad_raw *raw = container_of(kref, struct gamepad_raw, kref);
+
+	vfree(raw->header);
+	kfree(raw);
+}
+
+static int gamepad_raw_open(struct inode *inode, struct file *file) {
+	// The misc core holds its lock here, the device can't be removed meanwhile
+	struct gamepad_raw *raw = container_of(file->private_data, struct gamepad_raw, misc);
+
+	kref_get(&raw->kref);
+	file->private_data = raw;
+
+	return 0;
+}
+
+static int gamepad_raw_close(struct inode *inode, struct file *file) {
+	struct gamepad_raw *raw = file->private_data;
+
+	kref_put(&raw->kref, gamepad_raw_release);
+
+	return 0;
+}
+
+// The mapping keeps the file and so the ring alive
+static int gamepad_raw_mmap(struct file *file, struct vm_area_struct *vma) {
+	struct gamepad_raw *raw = file->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > raw->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, raw->header, 0);
+}
+
+static __poll_t gamepad_raw_poll(struct file *file, poll_table *wait) {
+	struct gamepad_raw *raw = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &raw->wait, wait);
+
+	if (smp_load_acquire(&raw->header->head) != READ_ONCE(raw->header->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(raw->gone))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static const struct file_operations gamepad_raw_fops = {
+	.owner = THIS_MODULE,
+	.open = gamepad_raw_open,
+	.release = gamepad_raw_close,
+	.mmap = gamepad_raw_mmap,
+	.poll = gamepad_raw_poll,
+	.llseek = noop_llseek,
+};
+
+// Optional, the gamepad works the same without it
+static int gamepad_raw_create(struct gamepad *gamepad) {
+	struct gamepad_raw *raw;
+	unsigned int entries;
+	int error;
+
+	entries = clamp_t(unsigned int, raw_entries, RAW_ENTRIES_MIN, RAW_ENTRIES_MAX);
+	entries = rounddown_pow_of_two(entries);
+
+	raw = kzalloc(sizeof(*raw), GFP_KERNEL);
+	if (!raw)
+		return -ENOMEM;
+
+	kref_init(&raw->kref);
+	init_waitqueue_head(&raw->wait);
+	raw->entries = entries;
+	raw->size = PAGE_SIZE + PAGE_ALIGN(entries * sizeof(struct gamepad_raw_entry));
+
+	// Zeroed and ready to be mapped
+	raw->header = vmalloc_user(raw->size);
+	if (!raw->header) {
+		kfree(raw);
+		return -ENOMEM;
+	}
+	raw->ring = (struct gamepad_raw_entry *)((uint8_t *)raw->header + PAGE_SIZE);
+	raw->header->entries = entries;
+	raw->header->entry_size = sizeof(struct gamepad_raw_entry);
+	raw->header->offset = PAGE_SIZE;
+
+	raw->id = ida_alloc(&gamepad_raw_ida, GFP_KERNEL);
+	if (raw->id < 0) {
+		error = raw->id;
+		gamepad_raw_release(&raw->kref);
+		return error;
+	}
+	snprintf(raw->name, sizeof(raw->name), DRIVER_NAME "-raw%d", raw->id);
+
+	raw->misc.minor = MISC_DYNAMIC_MINOR;
+	raw->misc.name = raw->name;
+	raw->misc.fops = &gamepad_raw_fops;
+	raw->misc.parent = &gamepad->usb_interface->dev;
+	error = misc_register(&raw->misc);
+	if (error) {
+		ida_free(&gamepad_raw_ida, raw->id);
+		gamepad_raw_release(&raw->kref);
+		return error;
+	}
+
+	spin_lock_irq(&gamepad->usb_in_lock);
+	gamepad->raw = raw;
+	spin_unlock_irq(&gamepad->usb_in_lock);
+
+	log_info("Raw reports in /dev/%s\n", raw->name);
+
+	return 0;
+}
+
+// Open files and mappings stay valid, the reader sees EPOLLHUP
+static void gamepad_raw_destroy(struct gamepad *gamepad) {
+	struct gamepad_raw *raw = gamepad->raw;
+
+	if (!raw)
+		return;
+
+	// No input callback touches the ring afterwards
+	spin_lock_irq(&gamepad->usb_in_lock);
+	gamepad->raw = NULL;
+	spin_unlock_irq(&gamepad->usb_in_lock);
+
+	misc_deregister(&raw->misc);
+	ida_free(&gamepad_raw_ida, raw->id);
+
+	WRITE_ONCE(raw->gone, true);
+	wake_up_interruptible_poll(&raw->wait, EPOLLHUP);
+
+	kref_put(&raw->kref, gamepad_raw_release);
+}
+
+
+/******************************************************************************
+ * Self test in debugfs
+ ******************************************************************************/
+
+// A gamepad without hardware, for the self test and the benchmark
+struct gamepad_test {
+	struct gamepad gamepad;
+	uint8_t packets[GAMEPAD_OUT_COUNT][PACKET_SIZE]; // Output, never sent
+};
+
+// Create an Ultimate 2C with the default settings, but without USB
+// The reports take the same way into its input device as those of a real
+// gamepad, but the input device is never registered, so no one else sees
+// them. The gamepad is inactive and drops rumble requests, unless the
+// benchmark activates it.
+static struct gamepad_test *gamepad_test_create(void) {
+	struct gamepad_test *test;
+	struct gamepad *gamepad;
+	int error;
+	int i;
+
+	test = kzalloc(sizeof(*test), GFP_KERNEL);
+	if (!test)
+		return ERR_PTR(-ENOMEM);
+
+	gamepad = &test->gamepad;
+	gamepad->model = &gamepad_model_u2c;
+	INIT_LIST_HEAD(&gamepad->list);
+	gamepad_hrtimer_setup(&gamepad->rumble_timer, gamepad_rumble_timer);
+	gamepad_hrtimer_setup(&gamepad->turbo_timer, gamepad_turbo_timer);
+	gamepad_hrtimer_setup(&gamepad->slow_timer, gamepad_slow_timer);
+	gamepad->turbo_enabled = true;
+	gamepad->rumble_sent = RUMBLE_UNKNOWN;
+	spin_lock_init(&gamepad->usb_in_lock);
+	seqcount_init(&gamepad->snapshot_seq);
+	mutex_init(&gamepad->config_lock);
+
+	// Settings as after probe with the default module parameters.
+	// No actions, they need the USB interface.
+	gamepad->trigger_mode = GAMEPAD_TRIGGER_DIGITAL;
+	for (i=0; i<GAMEPAD_STICK_COUNT; i++)
+		gamepad_calibration_reset(&gamepad->stick_calibration[i]);
+	gamepad_keymap_default_buttons(&gamepad->keymap, gamepad->model);
+	gamepad_keymap_default_chords(&gamepad->keymap, gamepad->model);
+	gamepad_keymap_compile(&gamepad->keymap);
+
+	// Output packets of the model, rumble_interval stays 0
+	for (i=0; i<GAMEPAD_OUT_COUNT; i++)
+		gamepad->usb_out[i].data = test->packets[i];
+	memcpy(test->packets[GAMEPAD_OUT_RUMBLE], gamepad->model->rumble, gamepad->model->rumble_size);
+	gamepad->usb_out[GAMEPAD_OUT_RUMBLE].size = gamepad->model->rumble_size;
+
+	error = gamepad_input_connect(gamepad);
+	if (error) {
+		gamepad_input_disconnect(gamepad);
+		kfree(test);
+		return ERR_PTR(error);
+	}
+
+	return test;
+}
+
+static void gamepad_test_destroy(struct gamepad_test *test) {
+	struct gamepad *gamepad = &test->gamepad;
+
+	gamepad->active = false;
+	gamepad_input_disconnect(gamepad);
+	hrtimer_cancel(&gamepad->rumble_timer);
+	hrtimer_cancel(&gamepad->slow_timer);
+	kfree(test);
+}
+
+// One report of the self test and the state it has to end up in
+// The reports are played in order, each one starts from the state the
+// one before left.
+struct gamepad_test_case {
+	const char *name;
+	uint8_t report[REPORT_SIZE];
+	uint32_t buttons;
+	uint8_t trigger_lt;
+	uint8_t trigger_rt;
+	int16_t sticks[4]; // Left X, left Y, right X, right Y
+	int events;        // Sent to the input system, without the sync
+	bool unchanged;    // Skipped as identical to the report before
+	bool unknown;      // Not a report with the gamepad state
+};
+
+static const struct gamepad_test_case gamepad_test_cases[] = {
+	{ .name = "idle" },
+	{ .name = "idle_again", .unchanged = true },
+	{
+		.name = "button_a",
+		.report = { [3] = 0x10 },
+		.buttons = GAMEPAD_MASK(BUTTON_A),
+		.events = 1,
+	},
+	{
+		// A released, D-Pad right as hat axis
+		.name = "dpad_right",
+		.report = { [2] = 0x08 },
+		.buttons = GAMEPAD_MASK(DPAD_RIGHT),
+		.events = 2,
+	},
+	{
+		// LT over the threshold, RT between the thresholds stays released
+		.name = "trigger_pressed",
+		.report = { [4] = 40, [5] = 20 },
+		.buttons = GAMEPAD_MASK(TRIGGER_LT),
+		.trigger_lt = 40,
+		.trigger_rt = 20,
+		.events = 2,
+	},
+	{
+		// Between the thresholds LT stays pressed
+		.name = "trigger_hysteresis",
+		.report = { [4] = 20 },
+		.buttons = GAMEPAD_MASK(TRIGGER_LT),
+		.trigger_lt = 20,
+	},
+	{
+		.name = "trigger_released",
+		.report = { [4] = 10 },
+		.trigger_lt = 10,
+		.events = 1,
+	},
+	{
+		// The buttons of the macro are hidden behind the chord
+		.name = "chord_l4",
+		.report = { [2] = 0xe0 },
+		.buttons = BIT(GAMEPAD_CHORD_FIRST),
+		.events = 1,
+	},
+	{
+		// L4 released, all four axes moved
+		.name = "sticks",
+		.report = { [6] = 0x34, 0x12, 0x9c, 0xff, 0xff, 0x7f, 0x00, 0x80 },
+		.sticks = { 0x1234, -100, 32767, -32768 },
+		.events = 5,
+	},
+	{
+		// Nothing changes
+		.name = "unknown_type",
+		.report = { 0x01 },
+		.sticks = { 0x1234, -100, 32767, -32768 },
+		.unknown = true,
+	},
+	{
+		.name = "released",
+		.events = 4,
+	},
+};
+
+// What differs between the state and the test case, NULL when nothing
+static const char *gamepad_test_compare(const struct gamepad_test_case *test, const struct gamepad_state *state) {
+	if (state->buttons != test->buttons)
+		return "buttons";
+	if (state->trigger_lt != test->trigger_lt || state->trigger_rt != test->trigger_rt)
+		return "triggers";
+	if (state->stick_left_x != test->sticks[0] || state->stick_left_y != test->sticks[1] ||
+			state->stick_right_x != test->sticks[2] || state->stick_right_y != test->sticks[3])
+		return "sticks";
+	return NULL;
+}
+
+// Play the test cases through gamepad_report_parse alone
+static unsigned int gamepad_test_parse(struct seq_file *m, struct gamepad *gamepad, unsigned int number) {
+	struct gamepad_state state = { 0 };
+	unsigned int passed = 0;
+	const char *error;
+	unsigned int i;
+
+	for (i=0; i<ARRAY_SIZE(gamepad_test_cases); i++) {
+		const struct gamepad_test_case *test = &gamepad_test_cases[i];
+
+		// Only reports of the type of the model get parsed
+		if (!test->unknown)
+			gamepad_report_parse(gamepad->model, gamepad->stick_calibration, gamepad->stick_filter,
+				&gamepad->keymap, test->report, &state);
+
+		error = gamepad_test_compare(test, &state);
+		if (error)
+			seq_printf(m, "not ok %u - parse %s: %s\n", number + i, test->name, error);
+		else {
+			seq_printf(m, "ok %u - parse %s\n", number + i, test->name);
+			passed++;
+		}
+	}
+
+	return passed;
+}
+
+// Play the test cases through gamepad_in_report into the input device
+static unsigned int gamepad_test_report(struct seq_file *m, struct gamepad *gamepad, unsigned int number) {
+	struct gamepad_snapshot snapshot;
+	unsigned int passed = 0;
+	unsigned long unchanged;
+	unsigned long unknown;
+	const char *error;
+	unsigned int i;
+	int events;
+
+	for (i=0; i<ARRAY_SIZE(gamepad_test_cases); i++) {
+		const struct gamepad_test_case *test = &gamepad_test_cases[i];
+
+		unchanged = atomic_long_read(&gamepad->stats.in_unchanged);
+		unknown = atomic_long_read(&gamepad->stats.in_unknown);
+
+		spin_lock_irq(&gamepad->usb_in_lock);
+		gamepad->usb_in_time = ktime_get();
+		events = gamepad_in_report(gamepad, test->report);
+		snapshot = gamepad->snapshot;
+		spin_unlock_irq(&gamepad->usb_in_lock);
+
+		error = gamepad_test_compare(test, &gamepad->state);
+		if (!error && events != test->events)
+			error = "events";
+		if (!error && atomic_long_read(&gamepad->stats.in_unchanged) - unchanged != test->unchanged)
+			error = "unchanged";
+		if (!error && atomic_long_read(&gamepad->stats.in_unknown) - unknown != test->unknown)
+			error = "unknown";
+		if (!error && !test->unknown && snapshot.buttons != test->buttons)
+			error = "snapshot";
+
+		if (error)
+			seq_printf(m, "not ok %u - report %s: %s\n", number + i, test->name, error);
+		else {
+			seq_printf(m, "ok %u - report %s\n", number + i, test->name);
+			passed++;
+		}
+	}
+
+	return passed;
+}
+
+// Results in the Test Anything Protocol, one line per test
+static int gamepad_test_show(struct seq_file *m, void *unused) {
+	const unsigned int count = ARRAY_SIZE(gamepad_test_cases);
+	struct gamepad_test *test;
+	unsigned int passed;
+
+	test = gamepad_test_create();
+	if (IS_ERR(test))
+		return PTR_ERR(test);
+
+	seq_printf(m, "1..%u\n", 2 * count);
+	passed = gamepad_test_parse(m, &test->gamepad, 1);
+	passed += gamepad_test_report(m, &test->gamepad, 1 + count);
+	seq_printf(m, "# passed %u of %u\n", passed, 2 * count);
+
+	gamepad_test_destroy(test);
+
+	return 0;
+}
 
-	// Data output
-	uint8_t *usb_out_data;
-	dma_addr_t usb_out_dma;
-	spinlock_t usb_out_lock;
-	struct urb *usb_out_urb;
-	struct usb_anchor usb_out_anchor;
+DEFINE_SHOW_ATTRIBUTE(gamepad_test);
 
-	bool usb_out_sending;
 
-	// Button, trigger and axis states
-	struct gamepad_state state;
+/******************************************************************************
+ * Replay and benchmark in debugfs
+ ******************************************************************************/
 
-	// Queue
-	bool rumble_off_pending;
+// Feed reports to the input path as if they came from USB, e.g. reports
+// recorded from the raw device. Any number of whole packets per write.
+static ssize_t gamepad_inject_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	struct gamepad *gamepad = file->private_data;
+	uint8_t data[PACKET_SIZE];
+	unsigned long flags;
+	size_t done;
+
+	if (count % PACKET_SIZE)
+		return -EINVAL;
+
+	// The button map doesn't change meanwhile
+	mutex_lock(&gamepad->config_lock);
+	for (done=0; done<count; done+=PACKET_SIZE) {
+		if (copy_from_user(data, buf + done, PACKET_SIZE))
+			break;
+		spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+		gamepad->usb_in_time = ktime_get();
+		gamepad_in_report(gamepad, data);
+		spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
+	}
+	mutex_unlock(&gamepad->config_lock);
 
-	// Debugging
-	bool heartbeat;
+	if (!done)
+		return -EFAULT;
+	return done;
+}
 
+static const struct file_operations gamepad_inject_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = gamepad_inject_write,
+	.llseek = noop_llseek,
 };
 
+// Settings of the gamepad and the recording, the benchmark works on copies
+struct gamepad_bench_context {
+	struct gamepad_keymap keymap;
+	struct gamepad_stick_calibration calibration[GAMEPAD_STICK_COUNT];
+	struct gamepad_stick_filter filter[GAMEPAD_STICK_COUNT];
+	uint8_t recording[BENCH_RECORDING][PACKET_SIZE];
+};
 
-// Gamepad initialisation
-static int gamepad_probe(struct usb_interface *interface, const struct usb_device_id *id);
-static void gamepad_disconnect(struct usb_interface *interface);
-static void gamepad_cleanup(struct gamepad *gamepad);
+// Build the reports of a stream, as the model would send them
+static void gamepad_bench_record(const struct gamepad_model *model, const struct gamepad_keymap *keymap,
+		unsigned int stream, uint8_t recording[][PACKET_SIZE]) {
+
+	const struct gamepad_layout *layout = model->layout;
+	unsigned int i, j;
+
+	for (i=0; i<BENCH_RECORDING; i++) {
+		uint8_t *data = recording[i];
+		unsigned int angle = i % 360;
+		uint32_t random = i * 2654435761U; // Good enough for mashing buttons
+		uint16_t buttons = 0;
+		uint8_t triggers[2] = { 0, 0 };
+		int16_t sticks[4] = { 0, 0, 0, 0 };
+
+		switch (stream) {
+		case GAMEPAD_BENCH_STICKS:
+			// One degree per report, the right stick the other way round
+			sticks[0] = fixp_cos16(angle);
+			sticks[1] = fixp_sin16(angle);
+			sticks[2] = fixp_sin16(angle);
+			sticks[3] = fixp_cos16(angle);
+			break;
+		case GAMEPAD_BENCH_BUTTONS:
+			buttons = random >> 16;
+			triggers[0] = random;
+			triggers[1] = random >> 8;
+			break;
+		case GAMEPAD_BENCH_CHORDS:
+			if (keymap->chord_count && !(i & 1))
+				buttons = keymap->chords[(i / 2) % keymap->chord_count].buttons;
+			break;
+		}
 
-// Sending messages
-static void gamepad_welcome_message(struct gamepad *gamepad);
-static void gamepad_rumble_message(struct gamepad *gamepad, uint16_t weak, uint16_t strong);
+		memset(data, 0, PACKET_SIZE);
+		data[0] = model->report_type;
+		data[layout->buttons] = buttons;
+		data[layout->buttons + 1] = buttons >> 8;
+		data[layout->trigger_lt] = triggers[0];
+		data[layout->trigger_rt] = triggers[1];
+		for (j=0; j<ARRAY_SIZE(sticks); j++) {
+			data[layout->sticks + 2 * j] = sticks[j];
+			data[layout->sticks + 2 * j + 1] = (uint16_t)sticks[j] >> 8;
+		}
+	}
+}
 
-// Callbacks for sending and receiving data
-static void gamepad_in_cb(struct urb *urb);
-static void gamepad_out_cb(struct urb *urb);
+// Play a stream through the same steps as gamepad_in_report, only the
+// input system is left out. The gamepad itself isn't touched.
+static int gamepad_bench_run(struct gamepad *gamepad, unsigned int stream, unsigned long packets) {
+
+	struct gamepad_bench_context *context;
+	struct gamepad_bench bench = { .valid = true, .stream = stream, .packets = packets };
+	struct gamepad_state state = { 0 };
+	struct gamepad_state reported = { 0 };
+	const uint8_t *last = NULL;
+	unsigned int trigger_mode;
+	unsigned int position = 0;
+	unsigned int events;
+	unsigned long i;
+	uint32_t keys;
+	u64 start;
+
+	context = kvzalloc(sizeof(*context), GFP_KERNEL);
+	if (!context)
+		return -ENOMEM;
 
-// Input system initialisation
-static int gamepad_input_connect(struct gamepad *gamepad);
-static void gamepad_input_process(struct gamepad *gamepad);
-static void gamepad_input_disconnect(struct gamepad *gamepad);
+	mutex_lock(&gamepad->config_lock);
+	context->keymap = gamepad->keymap;
+	keys = gamepad->input_keys;
+	trigger_mode = gamepad->trigger_mode;
+	mutex_unlock(&gamepad->config_lock);
 
-// Callback for force feedback
-static int gamepad_force_cb(struct input_dev *device, void *data, struct ff_effect *effect);
+	spin_lock_irq(&gamepad->usb_in_lock);
+	memcpy(context->calibration, gamepad->stick_calibration, sizeof(context->calibration));
+	spin_unlock_irq(&gamepad->usb_in_lock);
 
-/******************************************************************************
- * Code starts here
- ******************************************************************************/
+	gamepad_bench_record(gamepad->model, &context->keymap, stream, context->recording);
 
-// The game wants the gamepad to rumble
-static int gamepad_force_cb(struct input_dev *device, void *data, struct ff_effect *effect) {
-	struct gamepad *gamepad = input_get_drvdata(device);
+	start = ktime_get_ns();
+	for (i=0; i<packets; i++) {
+		const uint8_t *data = context->recording[position];
 
-	uint16_t strong;
-	uint16_t weak;
+		// Disconnect waits for the debugfs file, give up early
+		if (++position == BENCH_RECORDING) {
+			position = 0;
+			if (!READ_ONCE(gamepad->active) || fatal_signal_pending(current))
+				break;
+			cond_resched();
+		}
 
-	// We only support rumble, not the kinky stuff
-	if (effect->type != FF_RUMBLE)
-		return 0;
+		if (last && !memcmp(last, data, REPORT_SIZE) &&
+				!context->filter[GAMEPAD_STICK_LEFT].moving &&
+				!context->filter[GAMEPAD_STICK_RIGHT].moving) {
+			bench.unchanged++;
+			continue;
+		}
+		last = data;
+
+		gamepad_report_parse(gamepad->model, context->calibration, context->filter,
+			&context->keymap, data, &state);
+		events = gamepad_input_events(keys, trigger_mode, &state, &reported);
+		if (events) {
+			bench.events += events;
+			reported = state;
+		}
+	}
+	bench.ns = ktime_get_ns() - start;
 
-	weak = effect->u.rumble.weak_magnitude;
-	strong = effect->u.rumble.strong_magnitude;
+	kvfree(context);
+	if (i < packets)
+		return -EINTR;
 
-	gamepad_rumble_message(gamepad, weak, strong);
+	mutex_lock(&gamepad->config_lock);
+	gamepad->bench = bench;
+	mutex_unlock(&gamepad->config_lock);
 
 	return 0;
 }
 
-// Initialize the gamepad as input device
-static int gamepad_input_connect(struct gamepad *gamepad) {
+// A per packet value with two decimals
+static void gamepad_bench_ratio(struct seq_file *m, const char *name, u64 value, unsigned long packets) {
+	u64 ratio = div64_u64(value * 100, packets);
 
-	int error;
-	struct input_dev *device;
+	seq_printf(m, "%s: %llu.%02llu\n", name, ratio / 100, ratio % 100);
+}
 
-	// Create input device
-	device = input_allocate_device();
-	if (!device)
-		return -ENOMEM;
-	gamepad->input_device = device;
+static void gamepad_bench_print(struct seq_file *m, const struct gamepad_bench *bench) {
+	if (!bench->valid)
+		return;
 
-	// Say my name!
-	device->name = GAMEPAD_NAME;
+	seq_printf(m, "stream: %s\n", gamepad_bench_stream_names[bench->stream]);
+	seq_printf(m, "packets: %lu\n", bench->packets);
+	seq_printf(m, "unchanged: %lu\n", bench->unchanged);
+	seq_printf(m, "events: %lu\n", bench->events);
+	seq_printf(m, "time_ns: %llu\n", bench->ns);
+	gamepad_bench_ratio(m, "ns_per_packet", bench->ns, bench->packets);
+	gamepad_bench_ratio(m, "events_per_packet", bench->events, bench->packets);
 
-	// Setup a path to identify the gamepad
-	usb_make_path(gamepad->usb_device, gamepad->input_path, sizeof(gamepad->input_path));
-	strlcat(gamepad->input_path, "/input0", sizeof(gamepad->input_path));
-	device->phys = gamepad->input_path;
+	if (bench->stream != GAMEPAD_BENCH_RUMBLE)
+		return;
+	seq_printf(m, "rumble_coalesced: %lu\n", bench->rumble_coalesced);
+	seq_printf(m, "rumble_unchanged: %lu\n", bench->rumble_unchanged);
+	seq_printf(m, "rumble_sent: %lu\n", bench->rumble_sent);
+	gamepad_bench_ratio(m, "coalesced_ratio", bench->rumble_coalesced, bench->packets);
+	gamepad_bench_ratio(m, "not_sent_ratio", bench->packets - bench->rumble_sent, bench->packets);
+}
 
-	// Tell input device and USB about each other
-	usb_to_input_id(gamepad->usb_device, &device->id);
+static int gamepad_bench_show(struct seq_file *m, void *unused) {
+	struct gamepad *gamepad = m->private;
+	struct gamepad_bench bench;
 
-	// Map it to the correct point in sysfs tree
-	device->dev.parent = &gamepad->usb_interface->dev;
+	mutex_lock(&gamepad->config_lock);
+	bench = gamepad->bench;
+	mutex_unlock(&gamepad->config_lock);
 
-	// Map the gamepad to the input device
-	input_set_drvdata(device, gamepad);
+	gamepad_bench_print(m, &bench);
 
-	// Enable force feedback
-	input_set_capability(device, EV_FF, FF_RUMBLE);
-	error = input_ff_create_memless(device, NULL, gamepad_force_cb);
-	if (error)
-		return -ENOMEM;
-	gamepad->input_ff_active = true;
+	return 0;
+}
 
-	// Inform the input device about existing buttons, sticks, triggers
-	// Buttons on the right side
-	input_set_capability(device, EV_KEY, BTN_A);
-	input_set_capability(device, EV_KEY, BTN_B);
-	input_set_capability(device, EV_KEY, BTN_X);
-	input_set_capability(device, EV_KEY, BTN_Y);
+static int gamepad_bench_open(struct inode *inode, struct file *file) {
+	return single_open(file, gamepad_bench_show, inode->i_private);
+}
 
-	// D-Pad
-	// Assigned as axis rather than buttons on an Xbox layout
-	input_set_abs_params(device, ABS_HAT0X, -1, 1, 0, 0);
-	input_set_abs_params(device, ABS_HAT0Y, -1, 1, 0, 0);
+// "<stream> <packets>", e.g. "sticks 1000000"
+static int gamepad_bench_parse(const char __user *buf, size_t count, int *stream, unsigned long *packets) {
+	char name[16];
+	char *text;
+	int error;
 
-	// Middle buttons
-	input_set_capability(device, EV_KEY, BTN_START);
-	input_set_capability(device, EV_KEY, BTN_SELECT);
-	input_set_capability(device, EV_KEY, BTN_MODE);
+	if (count > 64)
+		return -EINVAL;
 
-	// Shoulder buttons
-	input_set_capability(device, EV_KEY, BTN_TL);
-	input_set_capability(device, EV_KEY, BTN_TR);
+	text = memdup_user_nul(buf, count);
+	if (IS_ERR(text))
+		return PTR_ERR(text);
 
-	input_set_capability(device, EV_KEY, BTN_TL2);
-	input_set_capability(device, EV_KEY, BTN_TR2);
+	error = -EINVAL;
+	if (sscanf(text, "%15s %lu", name, packets) == 2) {
+		*stream = match_string(gamepad_bench_stream_names, GAMEPAD_BENCH_STREAM_COUNT, name);
+		if (*stream >= 0 && *packets && *packets <= BENCH_PACKETS_MAX)
+			error = 0;
+	}
+	kfree(text);
 
-	/* LT and RT as trigger - does not work as expected
-	input_set_abs_params(device, ABS_Z, 0, 255, 0, 0);
-	input_set_abs_params(device, ABS_RZ, 0, 255, 0, 0);
-	*/
+	return error;
+}
 
-	// Stick buttons
-	input_set_capability(device, EV_KEY, BTN_THUMBL);
-	input_set_capability(device, EV_KEY, BTN_THUMBR);
+static ssize_t gamepad_bench_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	struct gamepad *gamepad = ((struct seq_file *)file->private_data)->private;
+	unsigned long packets;
+	int stream;
+	int error;
 
-	// L4 and R4
-	input_set_capability(device, EV_KEY, BTN_TRIGGER_HAPPY1);
-	input_set_capability(device, EV_KEY, BTN_TRIGGER_HAPPY2);
+	// Rumble would shake the real gamepad, only the test gamepad plays it
+	error = gamepad_bench_parse(buf, count, &stream, &packets);
+	if (!error && stream == GAMEPAD_BENCH_RUMBLE)
+		error = -EINVAL;
+	if (!error)
+		error = gamepad_bench_run(gamepad, stream, packets);
 
-	// Sticks with axes
-	// Left
-	input_set_abs_params(device, ABS_X, -32768, 32767, 16, 128);
-	input_set_abs_params(device, ABS_Y, -32768, 32767, 16, 128);
-	// Right
-	input_set_abs_params(device, ABS_RX, -32768, 32767, 16, 128);
-	input_set_abs_params(device, ABS_RY, -32768, 32767, 16, 128);
+	return error ? error : count;
+}
 
-	// Register device
-	error = input_register_device(device);
-	if (error)
-		return -ENOMEM;
-	gamepad->input_device_active = true;
+static const struct file_operations gamepad_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = gamepad_bench_open,
+	.read = seq_read,
+	.write = gamepad_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	return 0;
+// Add the files to the debugfs directory of the gamepad
+static void gamepad_bench_debugfs(struct gamepad *gamepad) {
+	debugfs_create_file("inject", 0200, gamepad->debugfs_dir, gamepad, &gamepad_inject_fops);
+	debugfs_create_file("bench", 0600, gamepad->debugfs_dir, gamepad, &gamepad_bench_fops);
 }
 
-// Disconnect input device
-static void gamepad_input_disconnect(struct gamepad *gamepad) {
+// Benchmark without a gamepad
+// Runs on a gamepad from gamepad_test_create with the default settings,
+// the reports take the whole way into its input device. The rumble requests
+// go through gamepad_rumble_message, the output finishes a transfer after
+// every BENCH_RUMBLE_BURST requests.
+static struct gamepad_bench gamepad_test_bench;
+static DEFINE_MUTEX(gamepad_test_bench_lock);
+
+// The transfer is done, as in gamepad_out_cb after a good one
+static void gamepad_test_out_complete(struct gamepad *gamepad) {
+	gamepad_stat_inc(gamepad, out_packets);
+	gamepad_out_release(gamepad);
+	gamepad_rumble_flush(gamepad);
+}
 
-	// Unregister the input device when active
-	if (gamepad->input_device_active) {
-		// Bye bye
-		input_unregister_device(gamepad->input_device);
-		gamepad->input_device_active = false;
-	}
+// One request of the rumble stream, both motors follow slow waves. Near the
+// peaks the motor bytes stay the same for a while.
+static void gamepad_test_rumble(struct gamepad *gamepad, unsigned long i) {
+	unsigned int angle = i % 360;
 
-	// Something went wrong when initializing the input device.
-	// We need some manual cleanup:
-	else {
-		// Only destroy FF when we do not call input_unregister_device
-		if (gamepad->input_ff_active) {
-			input_ff_destroy(gamepad->input_device);
-			gamepad->input_ff_active = false;
-		}
+	gamepad_rumble_message(gamepad, fixp_cos16(angle) + 0x8000, fixp_sin16(angle) + 0x8000);
+	if (i % BENCH_RUMBLE_BURST == BENCH_RUMBLE_BURST - 1)
+		gamepad_test_out_complete(gamepad);
+}
 
-		// Free the input device
-		if (gamepad->input_device) {
-			input_free_device(gamepad->input_device);
-			gamepad->input_device = 0;
+static int gamepad_test_bench_run(unsigned int stream, unsigned long packets) {
+	struct gamepad_bench bench = { .valid = true, .stream = stream, .packets = packets };
+	uint8_t (*recording)[PACKET_SIZE] = NULL;
+	struct gamepad_test *test;
+	struct gamepad *gamepad;
+	unsigned int position = 0;
+	unsigned long i;
+	int events;
+	u64 start;
+
+	test = gamepad_test_create();
+	if (IS_ERR(test))
+		return PTR_ERR(test);
+	gamepad = &test->gamepad;
+
+	if (stream != GAMEPAD_BENCH_RUMBLE) {
+		recording = kvmalloc_array(BENCH_RECORDING, PACKET_SIZE, GFP_KERNEL);
+		if (!recording) {
+			gamepad_test_destroy(test);
+			return -ENOMEM;
 		}
+		gamepad_bench_record(gamepad->model, &gamepad->keymap, stream, recording);
 	}
+	else
+		gamepad->active = true;
+
+	start = ktime_get_ns();
+	for (i=0; i<packets; i++) {
+		const uint8_t *data = recording ? recording[position] : NULL;
+
+		// Module unloading waits for the debugfs file, give up early
+		if (++position == BENCH_RECORDING) {
+			position = 0;
+			if (fatal_signal_pending(current))
+				break;
+			cond_resched();
+		}
 
-}
-
-// Process input from the gamepad
-static void gamepad_input_process(struct gamepad *gamepad) {
+		if (!data) {
+			gamepad_test_rumble(gamepad, i);
+			continue;
+		}
 
-	struct input_dev *device = gamepad->input_device;
-	struct gamepad_state *state = &gamepad->state;
+		// As in gamepad_in_cb, with the sync
+		spin_lock_irq(&gamepad->usb_in_lock);
+		gamepad->usb_in_time = ktime_get();
+		events = gamepad_in_report(gamepad, data);
+		spin_unlock_irq(&gamepad->usb_in_lock);
+		if (events)
+			bench.events += events + 1;
+	}
+	bench.ns = ktime_get_ns() - start;
 
-	if (gamepad->input_device_active) {
+	// The last transfers, until nothing waits in the mailbox
+	while (test_bit(GAMEPAD_OUT_BUSY, &gamepad->usb_out_flags))
+		gamepad_test_out_complete(gamepad);
 
-		// Simple debugging:
-		// log_info("BUTTON A %d\n", gamepad->button_a);
+	bench.unchanged = atomic_long_read(&gamepad->stats.in_unchanged);
+	bench.rumble_coalesced = atomic_long_read(&gamepad->stats.rumble_coalesced);
+	bench.rumble_unchanged = atomic_long_read(&gamepad->stats.rumble_unchanged);
+	bench.rumble_sent = atomic_long_read(&gamepad->stats.out_packets);
 
-		input_report_key(device, BTN_A, state->button_a);
-		input_report_key(device, BTN_B, state->button_b);
-		input_report_key(device, BTN_X, state->button_y); // X and Y
-		input_report_key(device, BTN_Y, state->button_x); // need to be swapped
+	kvfree(recording);
+	gamepad_test_destroy(test);
+	if (i < packets)
+		return -EINTR;
 
-		input_report_abs(device, ABS_HAT0X, state->dpad_left*(-1) + state->dpad_right);
-		input_report_abs(device, ABS_HAT0Y, state->dpad_top*(-1) + state->dpad_bottom);
+	mutex_lock(&gamepad_test_bench_lock);
+	gamepad_test_bench = bench;
+	mutex_unlock(&gamepad_test_bench_lock);
 
-		input_report_key(device, BTN_TL, state->button_lb);
-		input_report_key(device, BTN_TR, state->button_rb);
+	return 0;
+}
 
-		input_report_key(device, BTN_THUMBL, state->button_stick_left);
-		input_report_key(device, BTN_THUMBR, state->button_stick_right);
+static int gamepad_test_bench_show(struct seq_file *m, void *unused) {
+	struct gamepad_bench bench;
 
-		input_report_key(device, BTN_TRIGGER_HAPPY1, state->button_l4);
-		input_report_key(device, BTN_TRIGGER_HAPPY2, state->button_r4);
+	mutex_lock(&gamepad_test_bench_lock);
+	bench = gamepad_test_bench;
+	mutex_unlock(&gamepad_test_bench_lock);
 
-		input_report_key(device, BTN_START, state->button_plus);
-		input_report_key(device, BTN_SELECT, state->button_minus);
-		input_report_key(device, BTN_MODE, state->button_menu);
+	gamepad_bench_print(m, &bench);
 
-		input_report_abs(device, ABS_X, state->stick_left_x);
-		input_report_abs(device, ABS_Y, -state->stick_left_y); // Y axis is mirrored
-		input_report_abs(device, ABS_RX, state->stick_right_x);
-		input_report_abs(device, ABS_RY, -state->stick_right_y); // here too
+	return 0;
+}
 
-		input_report_key(device, BTN_TL2, state->trigger_lt_button);
-		input_report_key(device, BTN_TR2, state->trigger_rt_button);
+static int gamepad_test_bench_open(struct inode *inode, struct file *file) {
+	return single_open(file, gamepad_test_bench_show, NULL);
+}
 
-		/* LT and RT as trigger - does not work as expected
-		input_report_abs(device, ABS_Z, state->trigger_lt);
-		input_report_abs(device, ABS_RZ, state->trigger_rt);
-		*/
+static ssize_t gamepad_test_bench_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	unsigned long packets;
+	int stream;
+	int error;
 
-		input_sync(device);
-	}
+	error = gamepad_bench_parse(buf, count, &stream, &packets);
+	if (!error)
+		error = gamepad_test_bench_run(stream, packets);
 
+	return error ? error : count;
 }
 
-// Callback for incoming data
-static void gamepad_in_cb(struct urb *urb) {
-	struct gamepad *gamepad = urb->context;
-	struct gamepad_state *state = &gamepad->state;
-
-	int status = urb->status;
-	bool macro_lr4 = false;
-
-	uint8_t *data = gamepad->usb_in_data;
-
-
-	// Simple debugging:
-	// print_hex_dump(KERN_INFO, DRIVER_NAME ": ", DUMP_PREFIX_OFFSET, 32, 1, gamepad->usb_in_data, PACKET_SIZE, 0);
-
-	if (data[0] == 0x00) {
-
-		// Button mapping
-		state->dpad_top           = data[2] & 1;
-		state->dpad_bottom        = data[2] & 2;
-		state->dpad_left          = data[2] & 4;
-		state->dpad_right         = data[2] & 8;
-
-		state->button_plus        = data[2] & 16;
-		state->button_minus       = data[2] & 32;
-		state->button_stick_left  = data[2] & 64;
-		state->button_stick_right = data[2] & 128;
-
-		state->button_lb          = data[3] & 1;
-		state->button_rb          = data[3] & 2;
-		state->button_menu        = data[3] & 4;
-
-		state->button_a           = data[3] & 16;
-		state->button_b           = data[3] & 32;
-		state->button_x           = data[3] & 64;
-		state->button_y           = data[3] & 128;
-
-		// Trigger
-		state->trigger_lt         = data[4];
-		state->trigger_rt         = data[5];
-
-		// Virtual buttons from triggers
-		if (state->trigger_lt < 16)
-			state->trigger_lt_button = false;
-		else if (state->trigger_lt > 32)
-			state->trigger_lt_button = true;
-		if (state->trigger_rt < 16)
-			state->trigger_rt_button = false;
-		else if (state->trigger_rt > 32)
-			state->trigger_rt_button = true;
-
-		// Axis
-		state->stick_left_x       = (data[7]<<8) + data[6];
-		state->stick_left_y       = (data[9]<<8) + data[8];
-		state->stick_right_x      = (data[11]<<8) + data[10];
-		state->stick_right_y      = (data[13]<<8) + data[12];
-
-		// Experimental: Shoulder buttons L4 and R4
-		// L4
-		state->button_l4 = false;
-		if (
-			state->button_stick_left
-			&& state->button_stick_right
-			&& state->button_minus
-		) {
-			macro_lr4 = true;
-			state->button_l4 = true;
-		}
-		// R4
-		state->button_r4 = false;
-		if (
-			state->button_stick_left
-			&& state->button_stick_right
-			&& state->button_plus
-		) {
-			macro_lr4 = true;
-			state->button_r4 = true;
-		}
-		// Reset macro helper buttons
-		if (macro_lr4) {
-			state->button_stick_left = false;
-			state->button_stick_right = false;
-			state->button_plus = false;
-			state->button_minus = false;
-		}
-
-		// Heartbeat to the kernel log
-		if (
-			state->button_plus
-			&& state->button_minus
-			&& state->button_lb
-			&& state->button_rb
-		) {
-			if (!gamepad->heartbeat) {
-				log_info("Heartbeat! (L + R + Plus + Minus)\n");
-				gamepad->heartbeat = true;
-			}
-		}
-		else
-			gamepad->heartbeat = false;
+static const struct file_operations gamepad_test_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = gamepad_test_bench_open,
+	.read = seq_read,
+	.write = gamepad_test_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-		gamepad_input_process(gamepad);
-	}
 
-	// Success
-	if (status == 0) {
+/******************************************************************************
+ * State snapshot in debugfs
+ ******************************************************************************/
 
-		// Only send packets to active gamepads
-		if (gamepad->active)
-			usb_submit_urb(gamepad->usb_in_urb, GFP_KERNEL);
-	}
+// Publish the state the input system got, with the report it came from
+// Called with usb_in_lock held, which keeps the writers apart. Readers
+// never wait for the lock, they retry when a report came in between.
+static void gamepad_snapshot_publish(struct gamepad *gamepad) {
+	struct gamepad_snapshot *snapshot = &gamepad->snapshot;
+	const struct gamepad_state *state = &gamepad->state;
+
+	write_seqcount_begin(&gamepad->snapshot_seq);
+	snapshot->timestamp = ktime_to_ns(gamepad->usb_in_time);
+	snapshot->sequence = gamepad->usb_in_delivered;
+	snapshot->buttons = state->buttons;
+	snapshot->stick_left_x = state->stick_left_x;
+	snapshot->stick_left_y = state->stick_left_y;
+	snapshot->stick_right_x = state->stick_right_x;
+	snapshot->stick_right_y = state->stick_right_y;
+	snapshot->trigger_lt = state->trigger_lt;
+	snapshot->trigger_rt = state->trigger_rt;
+	write_seqcount_end(&gamepad->snapshot_seq);
 }
 
-// Callback for outgoing data
-static void gamepad_out_cb(struct urb *urb) {
-	struct gamepad *gamepad = urb->context;
-
-	gamepad->usb_out_sending = false;
+// One struct gamepad_snapshot, read it again from offset 0 for the next sample
+static ssize_t gamepad_snapshot_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+	struct gamepad *gamepad = file->private_data;
+	struct gamepad_snapshot snapshot;
+	unsigned int seq;
 
-	// We skipped a rumble off message and need to resend it
-	if (gamepad->rumble_off_pending) {
-		gamepad_rumble_message(gamepad, 0, 0);
-	}
+	do {
+		seq = read_seqcount_begin(&gamepad->snapshot_seq);
+		snapshot = gamepad->snapshot;
+	} while (read_seqcount_retry(&gamepad->snapshot_seq, seq));
 
+	return simple_read_from_buffer(buf, count, ppos, &snapshot, sizeof(snapshot));
 }
 
-// Send rumble message
-static void gamepad_rumble_message(struct gamepad *gamepad, uint16_t weak, uint16_t strong) {
-	unsigned long flags;
+static const struct file_operations gamepad_snapshot_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = gamepad_snapshot_read,
+	.llseek = default_llseek,
+};
 
-	uint8_t data[16];
-	uint8_t len;
+static void gamepad_snapshot_debugfs(struct gamepad *gamepad) {
+	debugfs_create_file_size("state", 0444, gamepad->debugfs_dir, gamepad,
+		&gamepad_snapshot_fops, sizeof(struct gamepad_snapshot));
+}
 
-	int error;
 
-	// Only send packets to active gamepads
-	if (!gamepad->active)
-		return;
+/******************************************************************************
+ * Latency statistics in debugfs
+ ******************************************************************************/
 
-	// Skip if already sending
-	// Unlikely event. We might skip a rumble, but the gamepad motors cannot
-	// handle two at the same time anyway.
-	if (gamepad->usb_out_sending) {
+#ifdef GAMEPAD_LATENCY_STATS
 
-		// However, we need to remember if the rumble should stop
-		// or the gamepad will rumble endless.
-		if (!weak && !strong)
-			gamepad->rumble_off_pending = true;
+// Add a value to a histogram
+static void gamepad_histogram_add(struct gamepad_histogram *histogram, u64 ns) {
+	unsigned int bucket = min_t(unsigned int, fls64(ns), LATENCY_BUCKETS - 1);
 
-		return;
-	}
+	if (!histogram->count || ns < histogram->min)
+		histogram->min = ns;
+	if (ns > histogram->max)
+		histogram->max = ns;
+	histogram->count++;
+	histogram->sum += ns;
+	histogram->buckets[bucket]++;
+}
 
-	// Rumble sequence
-	data[0] = 0x00;
-	data[1] = 0x08;
-	data[2] = 0x00;
+// A report arrived, called with usb_in_lock held
+static void gamepad_latency_completion(struct gamepad *gamepad) {
+	struct gamepad_latency *latency = &gamepad->latency;
 
-	// The left motor has the heavy weight. I opened the gamepad to verify this.
-	// Byte 3 controls the left motor
-	data[3] = strong / 256;
-	// Byte 4 controls the right motor
-	data[4] = weak / 256;
+	latency->completion = gamepad->usb_in_time;
+	if (latency->last_completion)
+		gamepad_histogram_add(&latency->interval,
+			ktime_to_ns(ktime_sub(latency->completion, latency->last_completion)));
+	latency->last_completion = latency->completion;
+}
 
-	data[5] = 0x00;
-	data[6] = 0x00;
-	data[7] = 0x00;
-	len = 8;
+// The report reached the input system, called with usb_in_lock held
+static void gamepad_latency_sync(struct gamepad *gamepad) {
+	struct gamepad_latency *latency = &gamepad->latency;
 
-	gamepad->usb_out_sending = true;
+	gamepad_histogram_add(&latency->processing,
+		ktime_to_ns(ktime_sub(ktime_get(), latency->completion)));
+}
 
-	if (!weak && !strong)
-		gamepad->rumble_off_pending = false;
+static void gamepad_histogram_show(struct seq_file *m, const char *name, const struct gamepad_histogram *histogram) {
+	unsigned int i;
 
-	spin_lock_irqsave(&gamepad->usb_out_lock, flags);
+	seq_printf(m, "%s:\n", name);
+	seq_printf(m, "  count: %llu\n", histogram->count);
+	if (!histogram->count)
+		return;
 
-	// Copy data
-	memcpy(gamepad->usb_out_data, data, len);
-	gamepad->usb_out_urb->transfer_buffer_length = len;
+	seq_printf(m, "  min: %llu ns\n", histogram->min);
+	seq_printf(m, "  max: %llu ns\n", histogram->max);
+	seq_printf(m, "  avg: %llu ns\n", div64_u64(histogram->sum, histogram->count));
 
-	// Send and look for errors
-	usb_anchor_urb(gamepad->usb_out_urb, &gamepad->usb_out_anchor);
-	error = usb_submit_urb(gamepad->usb_out_urb, GFP_ATOMIC);
-	if (error) {
-		usb_unanchor_urb(gamepad->usb_out_urb);
-		gamepad->usb_out_sending = false;
+	for (i=0; i<LATENCY_BUCKETS; i++) {
+		if (!histogram->buckets[i])
+			continue;
+		if (i == LATENCY_BUCKETS - 1)
+			seq_printf(m, "  %10llu ns and more: %u\n", 1ULL << (i - 1), histogram->buckets[i]);
+		else
+			seq_printf(m, "  %10llu - %10llu ns: %u\n",
+				i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1, histogram->buckets[i]);
 	}
-
-	spin_unlock_irqrestore(&gamepad->usb_out_lock, flags);
 }
 
-// Send initialisation message
-static void gamepad_welcome_message(struct gamepad *gamepad) {
+static int gamepad_latency_show(struct seq_file *m, void *unused) {
+	struct gamepad *gamepad = m->private;
+	struct gamepad_latency *latency;
 	unsigned long flags;
 
-	uint8_t data[16];
-	uint8_t len;
+	// Take a consistent copy, printing takes too long to hold the lock
+	latency = kmalloc(sizeof(*latency), GFP_KERNEL);
+	if (!latency)
+		return -ENOMEM;
 
-	int error;
+	spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+	*latency = gamepad->latency;
+	spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
 
-	// Only send packets to active gamepads
-	if (!gamepad->active)
-		return;
+	gamepad_histogram_show(m, "processing", &latency->processing);
+	gamepad_histogram_show(m, "interval", &latency->interval);
 
-	// Skip if already sending
-	if (gamepad->usb_out_sending)
-		return;
+	kfree(latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gamepad_latency);
 
-	// Xbox Gamepad LED message
-	// The Ultimate 2C Wireless gamepad doesn't even have a programmable LED,
-	// it still requires this message in order to start working.
-	// Don't ask me why. Wild guess: The gamepad needs a "heartbeat" or any
-	// signal from the host to know it is there.
+// Any write clears the statistics
+static ssize_t gamepad_latency_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	struct gamepad *gamepad = file->private_data;
+	unsigned long flags;
 
-	// So let's be nice and say hello:
-	data[0] = 0x01;
-	data[1] = 0x03;
-	data[2] = 0x00;
-	len = 3;
+	spin_lock_irqsave(&gamepad->usb_in_lock, flags);
+	memset(&gamepad->latency, 0, sizeof(gamepad->latency));
+	spin_unlock_irqrestore(&gamepad->usb_in_lock, flags);
 
-	gamepad->usb_out_sending = true;
+	return count;
+}
 
-	spin_lock_irqsave(&gamepad->usb_out_lock, flags);
+static const struct file_operations gamepad_latency_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = gamepad_latency_reset_write,
+	.llseek = noop_llseek,
+};
 
-	memcpy(gamepad->usb_out_data, data, len);
-	gamepad->usb_out_urb->transfer_buffer_length = len;
+// Add the statistics to the debugfs directory of the gamepad
+static void gamepad_latency_debugfs(struct gamepad *gamepad) {
+	debugfs_create_file("latency", 0444, gamepad->debugfs_dir, gamepad, &gamepad_latency_fops);
+	debugfs_create_file("latency_reset", 0200, gamepad->debugfs_dir, gamepad, &gamepad_latency_reset_fops);
+}
 
-	usb_anchor_urb(gamepad->usb_out_urb, &gamepad->usb_out_anchor);
-	error = usb_submit_urb(gamepad->usb_out_urb, GFP_ATOMIC);
-	if (error) {
-		usb_unanchor_urb(gamepad->usb_out_urb);
-		gamepad->usb_out_sending = false;
-	}
+#endif
 
-	spin_unlock_irqrestore(&gamepad->usb_out_lock, flags);
+// Size of the coherent block with all packet buffers
+static size_t gamepad_data_size(struct gamepad *gamepad) {
+	return (gamepad->usb_in_count + GAMEPAD_OUT_COUNT) * PACKET_SIZE;
 }
 
 // Initialisation, setup everything we need
@@ -593,8 +4831,13 @@ static int gamepad_probe(struct usb_interface *interface, const struct usb_devic
 	int i;
 	int error;
 	struct gamepad *gamepad;
+	const struct gamepad_model *model = (const struct gamepad_model *)id->driver_info;
+
+	// Ids added through new_id come without a model, take the Ultimate 2C
+	if (!model)
+		model = &gamepad_model_u2c;
 
-	log_info("Initialize gamepad " GAMEPAD_NAME " (Driver " DRIVER_NAME " " DRIVER_VERSION ")\n");
+	log_info("Initialize gamepad %s (Driver " DRIVER_NAME " " DRIVER_VERSION ")\n", model->name);
 
 	// Allocate gamepad object
 	gamepad = kzalloc(sizeof(*gamepad), GFP_KERNEL);
@@ -602,29 +4845,63 @@ static int gamepad_probe(struct usb_interface *interface, const struct usb_devic
 		return -ENOMEM;
 
 	gamepad->active = true;
+	gamepad->model = model;
+	INIT_LIST_HEAD(&gamepad->list);
+	kref_init(&gamepad->kref);
+	INIT_WORK(&gamepad->release_work, gamepad_release_work);
 	gamepad->usb_interface = interface;
-	gamepad->usb_device = interface_to_usbdev(interface);
+	gamepad->usb_device = usb_get_dev(interface_to_usbdev(interface));
 
 	// Bind gamepad to the USB interface
 	usb_set_intfdata(interface, gamepad);
 
+	// Deferred work, cleaned up by gamepad_cleanup
+	INIT_WORK(&gamepad->action_work, gamepad_action_work);
+	INIT_WORK(&gamepad->pm_work, gamepad_pm_work);
+	INIT_WORK(&gamepad->input_work, gamepad_input_work);
+	INIT_DELAYED_WORK(&gamepad->recover_work, gamepad_recover_work);
+	init_usb_anchor(&gamepad->usb_out_anchor);
+	gamepad_hrtimer_setup(&gamepad->rumble_timer, gamepad_rumble_timer);
+	gamepad_hrtimer_setup(&gamepad->turbo_timer, gamepad_turbo_timer);
+	gamepad_hrtimer_setup(&gamepad->slow_timer, gamepad_slow_timer);
+	gamepad->turbo_enabled = true;
+	gamepad->rumble_sent = RUMBLE_UNKNOWN;
+
 	// Allocate USB data
-	gamepad->usb_in_data = usb_alloc_coherent(gamepad->usb_device, PACKET_SIZE, GFP_KERNEL, &gamepad->usb_in_dma);
-	if (!gamepad->usb_in_data) {
+	// One block for all packets instead of one allocation per URB. Small
+	// coherent blocks come from the DMA pools of the host controller.
+	gamepad->usb_in_count = clamp_t(unsigned int, in_urbs, IN_URBS_MIN, IN_URBS_MAX);
+	gamepad->usb_data = usb_alloc_coherent(gamepad->usb_device, gamepad_data_size(gamepad), GFP_KERNEL, &gamepad->usb_dma);
+	if (!gamepad->usb_data) {
 		gamepad_cleanup(gamepad);
 		return -ENOMEM;
 	}
-	gamepad->usb_out_data = usb_alloc_coherent(gamepad->usb_device, PACKET_SIZE, GFP_KERNEL, &gamepad->usb_out_dma);
-	if (!gamepad->usb_out_data) {
-		gamepad_cleanup(gamepad);
-		return -ENOMEM;
+	for (i=0; i<gamepad->usb_in_count; i++) {
+		struct gamepad_in_slot *slot = &gamepad->usb_in_slots[i];
+		slot->gamepad = gamepad;
+		slot->data = gamepad->usb_data + i * PACKET_SIZE;
+		slot->dma = gamepad->usb_dma + i * PACKET_SIZE;
 	}
+	for (i=0; i<GAMEPAD_OUT_COUNT; i++) {
+		struct gamepad_out_buffer *buffer = &gamepad->usb_out[i];
+		buffer->data = gamepad->usb_data + (gamepad->usb_in_count + i) * PACKET_SIZE;
+		buffer->dma = gamepad->usb_dma + (gamepad->usb_in_count + i) * PACKET_SIZE;
+	}
+
+	// Output packets of the model, only the motor values change later
+	memcpy(gamepad->usb_out[GAMEPAD_OUT_RUMBLE].data, model->rumble, model->rumble_size);
+	gamepad->usb_out[GAMEPAD_OUT_RUMBLE].size = model->rumble_size;
+	memcpy(gamepad->usb_out[GAMEPAD_OUT_WELCOME].data, model->welcome, model->welcome_size);
+	gamepad->usb_out[GAMEPAD_OUT_WELCOME].size = model->welcome_size;
 
 	// Allocate USB URBs
-	gamepad->usb_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!gamepad->usb_in_urb) {
-		gamepad_cleanup(gamepad);
-		return -ENOMEM;
+	for (i=0; i<gamepad->usb_in_count; i++) {
+		struct gamepad_in_slot *slot = &gamepad->usb_in_slots[i];
+		slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!slot->urb) {
+			gamepad_cleanup(gamepad);
+			return -ENOMEM;
+		}
 	}
 	gamepad->usb_out_urb = usb_alloc_urb(0, GFP_KERNEL);
 	if (!gamepad->usb_out_urb) {
@@ -632,12 +4909,24 @@ static int gamepad_probe(struct usb_interface *interface, const struct usb_devic
 		return -ENOMEM;
 	}
 
-	// Anchor USB out
-	init_usb_anchor(&gamepad->usb_out_anchor);
-
 	// Init locks for later use
 	spin_lock_init(&gamepad->usb_in_lock);
-	spin_lock_init(&gamepad->usb_out_lock);
+	seqcount_init(&gamepad->snapshot_seq);
+	mutex_init(&gamepad->config_lock);
+
+	// Settings
+	gamepad->in_interval = min(in_interval, 255U);
+	gamepad->out_interval = min(out_interval, 255U);
+	gamepad->trigger_mode = trigger_mode < GAMEPAD_TRIGGER_MODE_COUNT ? trigger_mode : GAMEPAD_TRIGGER_DIGITAL;
+	gamepad->rumble_interval = min(rumble_interval, (unsigned int)RUMBLE_INTERVAL_MAX);
+	gamepad->slow_after = min(slow_after, (unsigned int)SLOW_AFTER_MAX);
+	gamepad->slow_interval = clamp(slow_interval, (unsigned int)SLOW_INTERVAL_MIN, (unsigned int)SLOW_INTERVAL_MAX);
+	for (i=0; i<GAMEPAD_STICK_COUNT; i++)
+		gamepad_calibration_reset(&gamepad->stick_calibration[i]);
+	gamepad_keymap_default_buttons(&gamepad->keymap, model);
+	gamepad_keymap_default_chords(&gamepad->keymap, model);
+	gamepad_keymap_compile(&gamepad->keymap);
+	gamepad_actions_default_set(gamepad);
 
 	// Find endpoints for in and output
 	for (i=0; i<interface->cur_altsetting->desc.bNumEndpoints; i++) {
@@ -654,39 +4943,51 @@ static int gamepad_probe(struct usb_interface *interface, const struct usb_devic
 		return -ENODEV;
 	}
 
-	// Init USB input
-	usb_fill_int_urb(gamepad->usb_in_urb, gamepad->usb_device,
-			 usb_rcvintpipe(gamepad->usb_device, gamepad->usb_endpoint_in->bEndpointAddress),
-			 gamepad->usb_in_data, PACKET_SIZE,
-			 gamepad_in_cb, gamepad,
-			 gamepad->usb_endpoint_in->bInterval);
-	gamepad->usb_in_urb->transfer_dma = gamepad->usb_in_dma;
-	gamepad->usb_in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	// Init USB output and say hello
+	gamepad_out_start(gamepad);
 
-	// Init USB output
-	usb_fill_int_urb(gamepad->usb_out_urb, gamepad->usb_device,
-		usb_sndintpipe(gamepad->usb_device, gamepad->usb_endpoint_out->bEndpointAddress),
-		gamepad->usb_out_data, PACKET_SIZE,
-		gamepad_out_cb, gamepad,
-		gamepad->usb_endpoint_out->bInterval);
-	gamepad->usb_out_urb->transfer_dma = gamepad->usb_out_dma;
-	gamepad->usb_out_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	// Debugging in /sys/kernel/debug/8bd-u2cw/<interface>/, e.g. 3-2:1.0.
+	// The USB path would be the same for every interface of the device.
+	gamepad->debugfs_dir = debugfs_create_dir(dev_name(&interface->dev), gamepad_debugfs_root);
+	gamepad_bench_debugfs(gamepad);
+	gamepad_snapshot_debugfs(gamepad);
+	gamepad_latency_debugfs(gamepad);
 
-	// Say hello
-	gamepad_welcome_message(gamepad);
+	// Init input device, right away or when the gamepad says hello.
+	// The probe of the next gamepad doesn't wait for the registration.
+	if (defer_input)
+		gamepad->input_pending = true;
+	else {
+		error = gamepad_input_connect(gamepad);
+		if (error) {
+			gamepad_cleanup(gamepad);
+			return error;
+		}
 
-	// Init input device
-	error = gamepad_input_connect(gamepad);
-	if (error) {
-		gamepad_cleanup(gamepad);
-		return error;
+		// Everything seems to be fine
+		log_info("Gamepad connected successfuly\n");
 	}
 
-	// Everything seems to be fine
-	log_info("Gamepad connected successfuly\n");
+	// Raw reports for user space, before the first report arrives
+	if (raw_device) {
+		error = gamepad_raw_create(gamepad);
+		if (error)
+			log_err("Raw device not available (%d)\n", error);
+	}
 
 	// Start input receiving
-	usb_submit_urb(gamepad->usb_in_urb, GFP_KERNEL);
+	gamepad_in_start(gamepad);
+
+	mutex_lock(&gamepad_list_lock);
+	list_add_tail(&gamepad->list, &gamepad_list);
+	mutex_unlock(&gamepad_list_lock);
+
+	// Autosuspend while idle, the gamepad wakes us up on input
+	interface->needs_remote_wakeup = 1;
+	if (idle_timeout) {
+		pm_runtime_set_autosuspend_delay(&gamepad->usb_device->dev, idle_timeout * 1000);
+		usb_enable_autosuspend(gamepad->usb_device);
+	}
 
 	return 0;
 }
@@ -700,25 +5001,78 @@ static void gamepad_disconnect(struct usb_interface *interface) {
 	log_info("Gamepad disconnected\n");
 }
 
-// Cleanup, free allocated memory before exiting
+// Cleanup, stop everything and drop our reference
+// Nothing here waits for the gamepad, the USB hub thread moves on to the
+// next device right away. Running output transfers finish on their own.
 static void gamepad_cleanup(struct gamepad *gamepad) {
 
+	int i;
+
+	// Nothing gets submitted from here on
 	gamepad->active = false;
+	smp_mb();
+
+	// Gone from the summary
+	mutex_lock(&gamepad_list_lock);
+	list_del_init(&gamepad->list);
+	mutex_unlock(&gamepad_list_lock);
+
+	// Stop the input ring for good. A poisoned URB can't be submitted
+	// again, not even by a callback running right now.
+	for (i=0; i<gamepad->usb_in_count; i++)
+		usb_poison_urb(gamepad->usb_in_slots[i].urb);
+
+	gamepad_raw_destroy(gamepad);
+
+	// Remove debugfs files, waits until nobody uses them.
+	// Nothing gets injected into the input device after this.
+	debugfs_remove_recursive(gamepad->debugfs_dir);
 
 	// Unregister input device
+	cancel_work_sync(&gamepad->input_work);
+	cancel_work_sync(&gamepad->action_work);
+	hrtimer_cancel(&gamepad->turbo_timer);
+	hrtimer_cancel(&gamepad->slow_timer);
 	gamepad_input_disconnect(gamepad);
 
-	// Clear all anchored URBs
-	if (!usb_wait_anchor_empty_timeout(&gamepad->usb_out_anchor, 200)) {
-		// Every URB that is not processed within a few milliseconds
-		// is most likely dead
-		usb_kill_anchored_urbs(&gamepad->usb_out_anchor);
-	}
+	cancel_work_sync(&gamepad->pm_work);
+	cancel_delayed_work_sync(&gamepad->recover_work);
+
+	// Only an output callback that saw the gamepad active just before can
+	// start the timer again, gamepad_release_work cancels it once more
+	hrtimer_cancel(&gamepad->rumble_timer);
+
+	// Cancel the output without waiting for it, the callback drops
+	// the reference of the transfer
+	usb_unlink_anchored_urbs(&gamepad->usb_out_anchor);
+
+	kref_put(&gamepad->kref, gamepad_release);
+}
+
+// Free everything, the last output callback may run in interrupt context
+static void gamepad_release(struct kref *kref) {
+	struct gamepad *gamepad = container_of(kref, struct gamepad, kref);
+
+	queue_work(gamepad_wq, &gamepad->release_work);
+}
+
+static void gamepad_release_work(struct work_struct *work) {
+
+	struct gamepad *gamepad = container_of(work, struct gamepad, release_work);
+	int i;
+
+	// A late output callback may have started the recovery or the
+	// rumble timer
+	cancel_delayed_work_sync(&gamepad->recover_work);
+	hrtimer_cancel(&gamepad->rumble_timer);
 
 	// Free USB URBs
-	if (gamepad->usb_in_urb) {
-		usb_free_urb(gamepad->usb_in_urb);
-		gamepad->usb_in_urb = 0;
+	for (i=0; i<gamepad->usb_in_count; i++) {
+		struct gamepad_in_slot *slot = &gamepad->usb_in_slots[i];
+		if (slot->urb) {
+			usb_free_urb(slot->urb);
+			slot->urb = 0;
+		}
 	}
 	if (gamepad->usb_out_urb) {
 		usb_free_urb(gamepad->usb_out_urb);
@@ -726,18 +5080,13 @@ static void gamepad_cleanup(struct gamepad *gamepad) {
 	}
 
 	// Free USB data
-	if (gamepad->usb_in_data) {
-		usb_free_coherent(gamepad->usb_device, PACKET_SIZE, gamepad->usb_in_data, gamepad->usb_in_dma);
-		gamepad->usb_in_data = 0;
-	}
-	if (gamepad->usb_out_data) {
-		usb_free_coherent(gamepad->usb_device, PACKET_SIZE, gamepad->usb_out_data, gamepad->usb_out_dma);
-		gamepad->usb_out_data = 0;
+	if (gamepad->usb_data) {
+		usb_free_coherent(gamepad->usb_device, gamepad_data_size(gamepad), gamepad->usb_data, gamepad->usb_dma);
+		gamepad->usb_data = 0;
 	}
 
+	usb_put_dev(gamepad->usb_device);
 	kfree(gamepad);
-
-	return;
 }
 
 
@@ -746,10 +5095,53 @@ static struct usb_driver module_driver = {
 	.name = DRIVER_NAME,
 	.probe = gamepad_probe,
 	.disconnect = gamepad_disconnect,
+	.suspend = gamepad_suspend,
+	.resume = gamepad_resume,
+	.reset_resume = gamepad_resume,
+	.supports_autosuspend = 1,
 	.id_table = module_device_table,
+	.dev_groups = gamepad_groups,
+	// Gamepads on one dongle or hub probe in parallel
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#else
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 };
 
-module_usb_driver(module_driver);
+// Load the module
+static int __init gamepad_module_init(void) {
+	int error;
+
+	gamepad_wq = alloc_workqueue(DRIVER_NAME, 0, 0);
+	if (!gamepad_wq)
+		return -ENOMEM;
+
+	gamepad_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+	debugfs_create_file("summary", 0444, gamepad_debugfs_root, NULL, &gamepad_summary_fops);
+	debugfs_create_file("selftest", 0400, gamepad_debugfs_root, NULL, &gamepad_test_fops);
+	debugfs_create_file("bench", 0600, gamepad_debugfs_root, NULL, &gamepad_test_bench_fops);
+
+	error = usb_register(&module_driver);
+	if (error) {
+		debugfs_remove_recursive(gamepad_debugfs_root);
+		destroy_workqueue(gamepad_wq);
+	}
+
+	return error;
+}
+
+// Unload the module
+static void __exit gamepad_module_exit(void) {
+	usb_deregister(&module_driver);
+	debugfs_remove_recursive(gamepad_debugfs_root);
+
+	// The USB core stopped all transfers, only the releases are left
+	destroy_workqueue(gamepad_wq);
+}
+
+module_init(gamepad_module_init);
+module_exit(gamepad_module_exit);
 
 MODULE_AUTHOR("Philipp Schwarz <pschwarzmail@gmail.com>");
 MODULE_DESCRIPTION("8BitDo Ultimate 2C Gamepad driver");
@@ -0,0 +1,37 @@
+# Benchmark of the loaded driver, run by make bench
+# Plays every built-in stream through the test gamepad of the driver, no
+# gamepad needed, see "Replay and benchmark" in the README.
+#
+# Usage: sudo ./bench.sh [packets]
+
+PACKETS=${1:-1000000}
+BENCH=/sys/kernel/debug/8bd-u2cw/bench
+STREAMS="idle sticks buttons chords"
+
+# Beautiful output
+green_echo() {
+  echo ""
+  printf '\e[32m== %s ==\e[0m\n' "$*"
+}
+
+set -e
+
+if [ ! -e "$BENCH" ]; then
+  echo "Error: $BENCH not found."
+  echo "Load the driver, mount debugfs and run this as root."
+  exit 1
+fi
+
+for STREAM in $STREAMS; do
+  green_echo "$STREAM, $PACKETS packets"
+  echo "$STREAM $PACKETS" > "$BENCH"
+  grep -E '^(ns_per_packet|events_per_packet|unchanged):' "$BENCH"
+done
+
+# Requests come faster than the output can send them
+green_echo "rumble, $PACKETS requests"
+echo "rumble $PACKETS" > "$BENCH"
+grep -E '^(ns_per_packet|rumble_coalesced|rumble_unchanged|rumble_sent|coalesced_ratio|not_sent_ratio):' "$BENCH"
+
+echo ""
+echo "Finished!"
@@ -67,10 +67,6 @@ sudo rmmod 8bd-u2cw.ko
 set -e
 echo "Done"
 
-green_echo "Load module ff_memless"
-sudo modprobe ff_memless
-echo "Done"
-
 green_echo "Load new module into kernel"
 sudo insmod 8bd-u2cw.ko
 echo "Done"
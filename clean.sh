@@ -12,5 +12,6 @@ rm -fv Module.symvers
 rm -fv modules.order
 rm -fv .Module.symvers.cmd
 rm -fv .modules.order.cmd
+rm -fv latency_probe
 
 echo "Done"
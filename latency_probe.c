@@ -0,0 +1,140 @@
+/******************************************************************************
+ * 8bd-u2cw Latency Probe
+ *
+ * Measures how long input events take from the USB transfer to user space.
+ * The driver dates every event with the completion of the USB transfer, the
+ * probe compares that time with the time it reads the event.
+ *
+ * Build: make latency_probe
+ * Usage: sudo ./latency_probe [/dev/input/eventN] [syncs]
+ *
+ * Without a device the first input device of the gamepad is used. Move the
+ * sticks or press buttons while it runs.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#define GAMEPAD_NAME "8BitDo Ultimate 2C"
+
+#define SYNCS_DEFAULT 1000
+#define BUCKETS 32 // Powers of two in microseconds
+
+// Find the input device of the gamepad by its name
+static int probe_open(char *path, size_t size) {
+	glob_t devices;
+	char name[256];
+	size_t i;
+	int fd = -1;
+
+	if (glob("/dev/input/event*", 0, NULL, &devices))
+		return -1;
+
+	for (i=0; i<devices.gl_pathc && fd < 0; i++) {
+		fd = open(devices.gl_pathv[i], O_RDONLY);
+		if (fd < 0)
+			continue;
+		if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) < 0 || strcmp(name, GAMEPAD_NAME)) {
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		snprintf(path, size, "%s", devices.gl_pathv[i]);
+	}
+
+	globfree(&devices);
+	return fd;
+}
+
+static long long probe_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	char path[256] = "";
+	struct input_event event;
+	unsigned long long buckets[BUCKETS] = { 0 };
+	unsigned long long count = 0;
+	unsigned long long syncs = SYNCS_DEFAULT;
+	long long min = 0;
+	long long max = 0;
+	long long sum = 0;
+	long long latency;
+	int clock = CLOCK_MONOTONIC;
+	int bucket;
+	int fd;
+	int i;
+
+	if (argc > 1 && argv[1][0] == '/') {
+		snprintf(path, sizeof(path), "%s", argv[1]);
+		fd = open(path, O_RDONLY);
+		argc--;
+		argv++;
+	}
+	else
+		fd = probe_open(path, sizeof(path));
+	if (argc > 1)
+		syncs = strtoull(argv[1], NULL, 0);
+	if (!syncs)
+		syncs = SYNCS_DEFAULT;
+
+	if (fd < 0) {
+		fprintf(stderr, "No input device of the gamepad found, run as root?\n");
+		return 1;
+	}
+
+	// The driver takes the time from the monotonic clock
+	if (ioctl(fd, EVIOCSCLOCKID, &clock) < 0) {
+		fprintf(stderr, "Setting the event clock failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("Reading %llu syncs from %s\n", syncs, path);
+
+	while (count < syncs) {
+		if (read(fd, &event, sizeof(event)) != sizeof(event)) {
+			fprintf(stderr, "Reading failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		// One sample per sync, all events before it have the same time
+		if (event.type != EV_SYN || event.code != SYN_REPORT)
+			continue;
+
+		latency = probe_now_ns() - (event.input_event_sec * 1000000000LL + event.input_event_usec * 1000LL);
+		if (!count || latency < min)
+			min = latency;
+		if (latency > max)
+			max = latency;
+		sum += latency;
+		count++;
+
+		for (bucket=0; bucket<BUCKETS - 1 && (latency / 1000) >> bucket; bucket++)
+			;
+		buckets[bucket]++;
+	}
+
+	printf("syncs: %llu\n", count);
+	printf("min: %lld ns\n", min);
+	printf("max: %lld ns\n", max);
+	printf("avg: %lld ns\n", sum / (long long)count);
+	for (i=0; i<BUCKETS; i++) {
+		if (buckets[i])
+			printf("  < %u us: %llu\n", 1u << i, buckets[i]);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,207 @@
+/******************************************************************************
+ * 8bd-u2cw Linux Driver - Tracepoints
+ *
+ * Events of the input and rumble pipeline for ftrace, perf and bpftrace.
+ * They cost next to nothing while tracing is off.
+ *
+ * Events: /sys/kernel/tracing/events/u2cw/
+ *
+ ******************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM u2cw
+
+// Why a rumble request did not go out as it was
+#ifndef _GAMEPAD_TRACE_TYPES
+#define _GAMEPAD_TRACE_TYPES
+enum gamepad_rumble_skip {
+	GAMEPAD_RUMBLE_COALESCED, // Replaced in the mailbox by a newer request
+	GAMEPAD_RUMBLE_UNCHANGED, // Already on the motors
+	GAMEPAD_RUMBLE_DELAYED,   // Waits for the minimum interval
+	GAMEPAD_RUMBLE_DROPPED,   // The gamepad is inactive
+};
+
+// Bus and device number, the self test has no USB device
+#define GAMEPAD_TRACE_BUS(udev) ((udev) ? (udev)->bus->busnum : 0)
+#define GAMEPAD_TRACE_DEV(udev) ((udev) ? (udev)->devnum : 0)
+#endif
+
+#if !defined(_GAMEPAD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GAMEPAD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+// An input URB completed
+TRACE_EVENT(gamepad_in_complete,
+	TP_PROTO(struct usb_device *udev, int status, unsigned int length, int type, u32 sequence),
+	TP_ARGS(udev, status, length, type, sequence),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, dev)
+		__field(int, status)
+		__field(unsigned int, length)
+		__field(int, type)
+		__field(u32, sequence)
+	),
+	TP_fast_assign(
+		__entry->bus = GAMEPAD_TRACE_BUS(udev);
+		__entry->dev = GAMEPAD_TRACE_DEV(udev);
+		__entry->status = status;
+		__entry->length = length;
+		__entry->type = type;
+		__entry->sequence = sequence;
+	),
+	TP_printk("%d-%d status=%d length=%u type=0x%02x sequence=%u",
+		__entry->bus, __entry->dev, __entry->status, __entry->length,
+		__entry->type & 0xff, __entry->sequence)
+);
+
+// A report changed the state, changed holds the buttons that flipped
+TRACE_EVENT(gamepad_state_change,
+	TP_PROTO(struct usb_device *udev, u32 buttons, u32 changed,
+		s16 left_x, s16 left_y, s16 right_x, s16 right_y, u8 lt, u8 rt),
+	TP_ARGS(udev, buttons, changed, left_x, left_y, right_x, right_y, lt, rt),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, dev)
+		__field(u32, buttons)
+		__field(u32, changed)
+		__field(s16, left_x)
+		__field(s16, left_y)
+		__field(s16, right_x)
+		__field(s16, right_y)
+		__field(u8, lt)
+		__field(u8, rt)
+	),
+	TP_fast_assign(
+		__entry->bus = GAMEPAD_TRACE_BUS(udev);
+		__entry->dev = GAMEPAD_TRACE_DEV(udev);
+		__entry->buttons = buttons;
+		__entry->changed = changed;
+		__entry->left_x = left_x;
+		__entry->left_y = left_y;
+		__entry->right_x = right_x;
+		__entry->right_y = right_y;
+		__entry->lt = lt;
+		__entry->rt = rt;
+	),
+	TP_printk("%d-%d buttons=%05x changed=%05x left=%d,%d right=%d,%d lt=%u rt=%u",
+		__entry->bus, __entry->dev, __entry->buttons, __entry->changed,
+		__entry->left_x, __entry->left_y, __entry->right_x, __entry->right_y,
+		__entry->lt, __entry->rt)
+);
+
+// Events went to the input system, followed by a sync
+TRACE_EVENT(gamepad_input_sync,
+	TP_PROTO(struct usb_device *udev, int events),
+	TP_ARGS(udev, events),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, dev)
+		__field(int, events)
+	),
+	TP_fast_assign(
+		__entry->bus = GAMEPAD_TRACE_BUS(udev);
+		__entry->dev = GAMEPAD_TRACE_DEV(udev);
+		__entry->events = events;
+	),
+	TP_printk("%d-%d events=%d", __entry->bus, __entry->dev, __entry->events)
+);
+
+// Rumble request from force feedback, motor bytes as they go into the mailbox
+TRACE_EVENT(gamepad_rumble_request,
+	TP_PROTO(struct usb_device *udev, u8 strong, u8 weak),
+	TP_ARGS(udev, strong, weak),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, dev)
+		__field(u8, strong)
+		__field(u8, weak)
+	),
+	TP_fast_assign(
+		__entry->bus = GAMEPAD_TRACE_BUS(udev);
+		__entry->dev = GAMEPAD_TRACE_DEV(udev);
+		__entry->strong = strong;
+		__entry->weak = weak;
+	),
+	TP_printk("%d-%d strong=%u weak=%u",
+		__entry->bus, __entry->dev, __entry->strong, __entry->weak)
+);
+
+// The values of the reasons go into the format file, for perf,
+// trace-cmd and bpftrace
+TRACE_DEFINE_ENUM(GAMEPAD_RUMBLE_COALESCED);
+TRACE_DEFINE_ENUM(GAMEPAD_RUMBLE_UNCHANGED);
+TRACE_DEFINE_ENUM(GAMEPAD_RUMBLE_DELAYED);
+TRACE_DEFINE_ENUM(GAMEPAD_RUMBLE_DROPPED);
+
+// Rumble request that did not go out as it was
+TRACE_EVENT(gamepad_rumble_skip,
+	TP_PROTO(struct usb_device *udev, enum gamepad_rumble_skip reason),
+	TP_ARGS(udev, reason),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, dev)
+		__field(int, reason)
+	),
+	TP_fast_assign(
+		__entry->bus = GAMEPAD_TRACE_BUS(udev);
+		__entry->dev = GAMEPAD_TRACE_DEV(udev);
+		__entry->reason = reason;
+	),
+	TP_printk("%d-%d %s", __entry->bus, __entry->dev,
+		__print_symbolic(__entry->reason,
+			{ GAMEPAD_RUMBLE_COALESCED, "coalesced" },
+			{ GAMEPAD_RUMBLE_UNCHANGED, "unchanged" },
+			{ GAMEPAD_RUMBLE_DELAYED, "delayed" },
+			{ GAMEPAD_RUMBLE_DROPPED, "dropped" }))
+);
+
+// Rumble packet handed to the host controller
+TRACE_EVENT(gamepad_rumble_submit,
+	TP_PROTO(struct usb_device *udev, u8 strong, u8 weak, int error),
+	TP_ARGS(udev, strong, weak, error),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, dev)
+		__field(u8, strong)
+		__field(u8, weak)
+		__field(int, error)
+	),
+	TP_fast_assign(
+		__entry->bus = GAMEPAD_TRACE_BUS(udev);
+		__entry->dev = GAMEPAD_TRACE_DEV(udev);
+		__entry->strong = strong;
+		__entry->weak = weak;
+		__entry->error = error;
+	),
+	TP_printk("%d-%d strong=%u weak=%u error=%d",
+		__entry->bus, __entry->dev, __entry->strong, __entry->weak, __entry->error)
+);
+
+// The output URB completed, rumble or welcome message
+TRACE_EVENT(gamepad_out_complete,
+	TP_PROTO(struct usb_device *udev, int status),
+	TP_ARGS(udev, status),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, dev)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->bus = GAMEPAD_TRACE_BUS(udev);
+		__entry->dev = GAMEPAD_TRACE_DEV(udev);
+		__entry->status = status;
+	),
+	TP_printk("%d-%d status=%d", __entry->bus, __entry->dev, __entry->status)
+);
+
+#endif
+
+// The kernel build looks for this file next to the driver, see the Makefile
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>